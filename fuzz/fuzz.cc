@@ -33,13 +33,10 @@ extern "C" int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size)
 {
     if (size < 2) return 0;
     uint8_t op = data[0];
-    auto contents = std::make_shared<std::vector<unsigned char>>(data + 1, data + size);
+    auto contents = std::make_shared<FileBuffer>(data + 1, data + size);
 
     try {
-        if (getElfType(contents).is32Bit)
-            fuzzOne(ElfFile<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Nhdr, Elf32_Addr, Elf32_Off, Elf32_Dyn, Elf32_Sym, Elf32_Versym, Elf32_Verdef, Elf32_Verdaux, Elf32_Verneed, Elf32_Vernaux, Elf32_Rel, Elf32_Rela, 32>(contents), op);
-        else
-            fuzzOne(ElfFile<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Nhdr, Elf64_Addr, Elf64_Off, Elf64_Dyn, Elf64_Sym, Elf64_Versym, Elf64_Verdef, Elf64_Verdaux, Elf64_Verneed, Elf64_Vernaux, Elf64_Rel, Elf64_Rela, 64>(contents), op);
+        withElfFile(contents, [&](auto && elf) { fuzzOne(std::move(elf), op); });
     } catch (std::exception &) {
     }
     return 0;
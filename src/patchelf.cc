@@ -17,16 +17,22 @@
  */
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <optional>
 #include <set>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -34,11 +40,21 @@
 #include <cassert>
 #include <cerrno>
 #include <cstdarg>
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
 #include <fcntl.h>
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/xattr.h>
+#endif
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -55,8 +71,17 @@
 #define O_BINARY 0
 #endif
 
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
 static bool debugMode = false;
 
+/* Where the output for the file being patched goes.  With --jobs, each
+   worker collects it in memory so that it can be emitted in input order. */
+static thread_local FILE * outStream = stdout;
+static thread_local FILE * errStream = stderr;
+
 static bool forceRPath = false;
 static bool clobberOldSections = true;
 
@@ -65,9 +90,28 @@ static bool clobberOldSections = true;
    rather than padding the file by gigabytes. */
 static constexpr unsigned maxSegmentAlignment = 0x1000000; /* 16 MiB */
 
+/* In older version of binutils (2.30), readelf would check if the dynamic
+   section segment is strictly smaller than the file (and not same size).
+   By making the file one byte larger than the last segment, we don't break
+   readelf. */
+static constexpr off_t binutilsQuirkPadding = 1;
+
 static std::vector<std::string> fileNames;
-static std::string outputFileName;
-static bool alwaysWrite = false;
+static int jobs = 1;
+static std::vector<std::string> recursiveDirs;
+static std::vector<std::string> batchManifests;
+
+/* With --jobs, the combined size of the files being patched at the same
+   time is kept below this; larger files are patched on their own. */
+static constexpr size_t maxInFlightBytes = size_t(1) << 31; /* 2 GiB */
+
+/* Set on the threads of a PatchPool, which already keeps --jobs threads
+   busy, so a single file should not start more of its own. */
+static thread_local bool inPatchPool = false;
+
+/* Symbol tables are only split across threads in parts of at least this
+   many entries. */
+static constexpr size_t minSymbolsPerThread = 1 << 16;
 #ifdef DEFAULT_PAGESIZE
 static int forcedPageSize = DEFAULT_PAGESIZE;
 #else
@@ -78,6 +122,40 @@ static int forcedPageSize = -1;
 #define EM_LOONGARCH    258
 #endif
 
+/* The number of parts that forSymbolParts() splits 'count' symbols into. */
+static size_t symbolParts(size_t count)
+{
+    return std::clamp<size_t>(count / minSymbolsPerThread, 1, inPatchPool ? 1 : jobs);
+}
+
+/* Calls f(part, begin, end) for each of the symbolParts(count) consecutive
+   parts of [0, count), all but the first on a thread of their own. This
+   splits large tables across the --jobs threads, unless those are busy
+   patching other files. An exception thrown for a part is rethrown once
+   all parts are done. */
+template<class F>
+static void forSymbolParts(size_t count, F && f)
+{
+    size_t parts = symbolParts(count);
+    std::vector<std::exception_ptr> failures(parts);
+    auto run = [&](size_t part) {
+        try {
+            f(part, count * part / parts, count * (part + 1) / parts);
+        } catch (...) {
+            failures[part] = std::current_exception();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t part = 1; part < parts; ++part)
+        threads.emplace_back(run, part);
+    run(0);
+    for (auto & thread : threads)
+        thread.join();
+    for (auto & failure : failures)
+        if (failure)
+            std::rethrow_exception(failure);
+}
+
 [[nodiscard]] static std::vector<std::string> splitColonDelimitedString(std::string_view s)
 {
     std::vector<std::string> parts;
@@ -113,14 +191,20 @@ static std::string downcase(std::string s)
     return s;
 }
 
+static constexpr bool hostLittleEndian = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+
 /* !!! G++ creates broken code if this function is inlined, don't know
    why... */
 template<ElfFileParams>
 template<class I>
 constexpr I ElfFile<ElfFileParamNames>::rdi(I i) const noexcept
 {
+    /* Files in the host's byte order need no conversion at all. */
+    if constexpr (LittleEndian == hostLittleEndian)
+        return i;
+
     I r = 0;
-    if (littleEndian) {
+    if constexpr (LittleEndian) {
         for (unsigned int n = 0; n < sizeof(I); ++n) {
             r |= ((I) *(((unsigned char *) &i) + n)) << (n * 8);
         }
@@ -138,7 +222,7 @@ static void debug(const char * format, ...)
     if (debugMode) {
         va_list ap;
         va_start(ap, format);
-        vfprintf(stderr, format, ap);
+        vfprintf(errStream, format, ap);
         va_end(ap);
     }
 }
@@ -182,6 +266,246 @@ struct SysError : std::runtime_error
     throw std::runtime_error(msg);
 }
 
+FileBuffer::~FileBuffer()
+{
+#ifndef _WIN32
+    if (mapping)
+        munmap(mapping, mappingSize);
+#endif
+    if (viewFd != -1)
+        close(viewFd);
+}
+
+
+std::shared_ptr<FileBuffer> FileBuffer::map([[maybe_unused]] int fd, [[maybe_unused]] size_t size)
+{
+#ifndef _WIN32
+    /* MAP_PRIVATE: in-place edits land in copy-on-write pages and never
+       reach the input file until writeFile() writes them out. */
+    void * p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+        return nullptr;
+
+    auto contents = std::make_shared<FileBuffer>();
+    contents->mapping = static_cast<unsigned char *>(p);
+    contents->mappingSize = size;
+
+#ifdef SEEK_HOLE
+    /* Holes read as zeros either way, but through the file mapping they
+       would still take up page cache.  Anonymous pages cost nothing
+       until they are written to. */
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    off_t hole = 0;
+    while ((hole = lseek(fd, hole, SEEK_HOLE)) >= 0 && (size_t) hole < size) {
+        off_t data = lseek(fd, hole, SEEK_DATA);
+        size_t holeEnd = data < 0 ? size : std::min((size_t) data, size);
+        size_t first = (hole + pageSize - 1) / pageSize * pageSize;
+        size_t last = holeEnd / pageSize * pageSize;
+        if (first < last && mmap(contents->mapping + first, last - first, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+            return nullptr;
+        if (data < 0)
+            break;
+        hole = data;
+    }
+#endif
+
+    return contents;
+#else
+    return nullptr;
+#endif
+}
+
+
+std::shared_ptr<FileBuffer> FileBuffer::view([[maybe_unused]] int fd, [[maybe_unused]] size_t size)
+{
+#ifndef _WIN32
+    /* Untouched pages of an anonymous mapping cost nothing, so reserving
+       the whole file is cheap even for huge binaries. */
+    void * p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        return nullptr;
+
+    auto contents = std::make_shared<FileBuffer>();
+    contents->mapping = static_cast<unsigned char *>(p);
+    contents->mappingSize = size;
+    contents->viewFd = fd;
+    return contents;
+#else
+    return nullptr;
+#endif
+}
+
+
+void FileBuffer::loadRange(size_t offset, size_t size)
+{
+    if (offset > mappingSize)
+        return;
+    size = std::min(size, mappingSize - offset);
+
+    for (auto & [begin, end] : loadedRanges)
+        if (begin <= offset && offset + size <= end)
+            return;
+
+    size_t bytesRead = 0;
+    while (bytesRead < size) {
+        ssize_t portion = pread(viewFd, mapping + offset + bytesRead, size - bytesRead, offset + bytesRead);
+        if (portion < 0 && errno == EINTR)
+            continue;
+        if (portion <= 0)
+            throw SysError("reading file contents");
+        bytesRead += portion;
+    }
+
+    loadedRanges.emplace_back(offset, offset + size);
+}
+
+
+/* Replace the mapping by an anonymous one that is 'gap' bytes larger,
+   with the new (zero) bytes at 'offset'. The pages are moved over
+   rather than copied, so for a mapped file this costs the same no
+   matter how much of it follows 'offset'. Returns false if this is not
+   possible, e.g. because the gap is not a whole number of pages. */
+bool FileBuffer::remapWithGap([[maybe_unused]] size_t offset, [[maybe_unused]] size_t gap)
+{
+#ifdef __linux__
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    const size_t mapped = (mappingSize + pageSize - 1) / pageSize * pageSize;
+    const bool append = offset >= mappingSize;
+
+    if (!append && gap % pageSize != 0)
+        return false;
+
+    void * p = mmap(nullptr, mappingSize + gap, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        return false;
+    auto * newMapping = static_cast<unsigned char *>(p);
+
+    /* Pages before the one containing 'offset' keep their position,
+       everything from there on moves up by 'gap'. */
+    size_t split = append ? mapped : offset / pageSize * pageSize;
+    if (split > 0 && mremap(mapping, split, split, MREMAP_MAYMOVE | MREMAP_FIXED, newMapping) == MAP_FAILED) {
+        munmap(newMapping, mappingSize + gap);
+        return false;
+    }
+
+    if (split < mapped) {
+        if (mremap(mapping + split, mapped - split, mapped - split,
+                MREMAP_MAYMOVE | MREMAP_FIXED, newMapping + split + gap) == MAP_FAILED) {
+            memcpy(newMapping + split + gap, mapping + split, mappingSize - split);
+            munmap(mapping + split, mapped - split);
+        }
+
+        /* The page containing 'offset' moved as a whole; put back the
+           part of it that precedes the gap. */
+        memcpy(newMapping + split, newMapping + split + gap, offset - split);
+        memset(newMapping + split + gap, 0, offset - split);
+    }
+
+    mapping = newMapping;
+    mappingSize += gap;
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+void FileBuffer::detach()
+{
+    if (!mapping)
+        return;
+    buffer.assign(mapping, mapping + mappingSize);
+#ifndef _WIN32
+    munmap(mapping, mappingSize);
+#endif
+    mapping = nullptr;
+    mappingSize = 0;
+}
+
+
+void FileBuffer::resize(size_t newSize, unsigned char fill)
+{
+    if (viewFd != -1)
+        error("cannot resize a partially read file");
+
+    if (mapping) {
+        auto oldSize = mappingSize;
+        if (newSize > oldSize && remapWithGap(oldSize, newSize - oldSize)) {
+            if (fill)
+                memset(mapping + oldSize, fill, newSize - oldSize);
+            return;
+        }
+        detach();
+    }
+    buffer.resize(newSize, fill);
+}
+
+
+void FileBuffer::insert(size_t offset, size_t size)
+{
+    if (viewFd != -1)
+        error("cannot resize a partially read file");
+
+    if (mapping) {
+        if (remapWithGap(offset, size))
+            return;
+        detach();
+    }
+    buffer.insert(buffer.begin() + offset, size, 0);
+}
+
+
+void DirtyRanges::insert(size_t offset, size_t size)
+{
+    std::vector<std::pair<size_t, size_t>> tails;
+    for (auto & r : ranges) {
+        if (r.first >= offset) {
+            r.first += size;
+            r.second += size;
+        } else if (r.second > offset) {
+            tails.emplace_back(offset + size, r.second + size);
+            r.second = offset;
+        }
+    }
+    ranges.insert(ranges.end(), tails.begin(), tails.end());
+
+    std::vector<Extent> newExtents;
+    for (auto & e : extents) {
+        if (e.offset >= offset)
+            newExtents.push_back({e.offset + size, e.sourceOffset, e.size});
+        else if (e.offset + e.size > offset) {
+            auto head = offset - e.offset;
+            newExtents.push_back({e.offset, e.sourceOffset, head});
+            newExtents.push_back({offset + size, e.sourceOffset + head, e.size - head});
+        } else
+            newExtents.push_back(e);
+    }
+    extents = std::move(newExtents);
+
+    add(offset, size);
+    inserted = true;
+}
+
+
+std::vector<std::pair<size_t, size_t>> DirtyRanges::merged() const
+{
+    auto sorted = ranges;
+    std::sort(sorted.begin(), sorted.end());
+
+    std::vector<std::pair<size_t, size_t>> result;
+    for (auto & r : sorted) {
+        if (!result.empty() && r.first <= result.back().second)
+            result.back().second = std::max(result.back().second, r.second);
+        else
+            result.push_back(r);
+    }
+    return result;
+}
+
+
 static FileContents readFile(const std::string & fileName,
     size_t cutOff = std::numeric_limits<size_t>::max())
 {
@@ -194,11 +518,20 @@ static FileContents readFile(const std::string & fileName,
 
     size_t size = std::min(cutOff, static_cast<size_t>(st.st_size));
 
-    FileContents contents = std::make_shared<std::vector<unsigned char>>(size);
-
     int fd = open(fileName.c_str(), O_RDONLY | O_BINARY);
     if (fd == -1) throw SysError(fmt("opening '", fileName, "'"));
 
+    /* Whole regular files are mapped rather than read, so that only the
+       pages we actually look at or modify are ever copied. */
+    if (S_ISREG(st.st_mode) && size > 0 && size == static_cast<size_t>(st.st_size)) {
+        if (auto contents = FileBuffer::map(fd, size)) {
+            close(fd);
+            return contents;
+        }
+    }
+
+    FileContents contents = std::make_shared<FileBuffer>(size);
+
     size_t bytesRead = 0;
     ssize_t portion;
     while ((portion = read(fd, contents->data() + bytesRead, size - bytesRead)) > 0)
@@ -213,13 +546,60 @@ static FileContents readFile(const std::string & fileName,
 }
 
 
+/* Open 'fileName' for read-only queries. Only the ELF header is read here;
+   ElfFile pulls in the program and section header tables, the section name
+   table and whatever sections a query looks at (.dynamic, .dynstr, .interp)
+   with FileBuffer::load(). A print on a multi-gigabyte binary thus reads a
+   few kilobytes. Falls back to readFile() if no view can be set up. */
+static FileContents readFileHeaders(const std::string & fileName)
+{
+    struct stat st;
+    if (stat(fileName.c_str(), &st) != 0)
+        throw SysError(fmt("getting info about '", fileName, "'"));
+
+    if (!S_ISREG(st.st_mode) || st.st_size == 0
+        || static_cast<uint64_t>(st.st_size) > static_cast<uint64_t>(std::numeric_limits<size_t>::max()))
+        return readFile(fileName);
+
+    int fd = open(fileName.c_str(), O_RDONLY | O_BINARY);
+    if (fd == -1) throw SysError(fmt("opening '", fileName, "'"));
+
+    auto contents = FileBuffer::view(fd, st.st_size);
+    if (!contents) {
+        close(fd);
+        return readFile(fileName);
+    }
+
+    contents->load(0, sizeof(Elf64_Ehdr));
+    return contents;
+}
+
+
 struct ElfType
 {
     bool is32Bit;
+    bool littleEndian;
     int machine; // one of EM_*
 };
 
 
+/* Check the first EI_NIDENT bytes of a file for something we can patch.
+   Returns what is wrong with them, or nullptr if nothing is. */
+[[nodiscard]] static const char * checkElfIdent(const unsigned char * ident)
+{
+    if (memcmp(ident, ELFMAG, SELFMAG) != 0)
+        return "not an ELF executable";
+
+    if (ident[EI_VERSION] != EV_CURRENT)
+        return "unsupported ELF version";
+
+    if (ident[EI_CLASS] != ELFCLASS32 && ident[EI_CLASS] != ELFCLASS64)
+        return "ELF executable is not 32 or 64 bit";
+
+    return nullptr;
+}
+
+
 [[nodiscard]] static ElfType getElfType(const FileContents & fileContents)
 {
     /* Check the ELF header for basic validity. */
@@ -228,19 +608,17 @@ struct ElfType
 
     auto contents = fileContents->data();
 
-    if (memcmp(contents, ELFMAG, SELFMAG) != 0)
-        error("not an ELF executable");
-
-    if (contents[EI_VERSION] != EV_CURRENT)
-        error("unsupported ELF version");
-
-    if (contents[EI_CLASS] != ELFCLASS32 && contents[EI_CLASS] != ELFCLASS64)
-        error("ELF executable is not 32 or 64 bit");
+    if (auto problem = checkElfIdent(contents))
+        error(problem);
 
     bool is32Bit = contents[EI_CLASS] == ELFCLASS32;
+    bool littleEndian = contents[EI_DATA] == ELFDATA2LSB;
 
-    // FIXME: endianness
-    return ElfType { is32Bit, is32Bit ? (reinterpret_cast<Elf32_Ehdr *>(contents))->e_machine : (reinterpret_cast<Elf64_Ehdr *>(contents))->e_machine };
+    /* e_machine is at the same offset in both classes. */
+    static_assert(offsetof(Elf32_Ehdr, e_machine) == offsetof(Elf64_Ehdr, e_machine));
+    auto machine = contents + offsetof(Elf32_Ehdr, e_machine);
+    return ElfType { is32Bit, littleEndian,
+        littleEndian ? machine[0] | machine[1] << 8 : machine[0] << 8 | machine[1] };
 }
 
 
@@ -276,6 +654,7 @@ static char * strTabEntry(span<char> strTab, uint64_t idx)
 static std::string extractString(const FileContents & contents, size_t offset, size_t size)
 {
     checkOffset(contents, offset, size);
+    contents->load(offset, size);
     return { reinterpret_cast<const char *>(contents->data()) + offset, size };
 }
 
@@ -283,6 +662,7 @@ static std::string extractString(const FileContents & contents, size_t offset, s
 template<ElfFileParams>
 ElfFile<ElfFileParamNames>::ElfFile(FileContents fContents)
     : fileContents(fContents)
+    , dirty(fContents->size())
 {
     /* Check the ELF header for basic validity. */
     if (fileContents->size() < (off_t) sizeof(Elf_Ehdr)) error("missing ELF header");
@@ -291,7 +671,8 @@ ElfFile<ElfFileParamNames>::ElfFile(FileContents fContents)
     if (memcmp(hdr()->e_ident, ELFMAG, SELFMAG) != 0)
         error("not an ELF executable");
 
-    littleEndian = hdr()->e_ident[EI_DATA] == ELFDATA2LSB;
+    if ((hdr()->e_ident[EI_DATA] == ELFDATA2LSB) != LittleEndian)
+        error("wrong ELF byte order");
 
     if (rdi(hdr()->e_type) != ET_EXEC && rdi(hdr()->e_type) != ET_DYN)
         error("wrong ELF type");
@@ -331,6 +712,9 @@ ElfFile<ElfFileParamNames>::ElfFile(FileContents fContents)
     if (rdi(hdr()->e_shentsize) != sizeof(Elf_Shdr))
         error("section headers have wrong size");
 
+    fileContents->load(rdi(hdr()->e_phoff), rdi(hdr()->e_phnum) * sizeof(Elf_Phdr));
+    fileContents->load(rdi(hdr()->e_shoff), rdi(hdr()->e_shnum) * sizeof(Elf_Shdr));
+
     /* Copy the program and section headers. e_{ph,sh}off come from the file
        and need not be naturally aligned, so memcpy instead of dereferencing. */
     for (int i = 0; i < rdi(hdr()->e_phnum); ++i) {
@@ -345,6 +729,7 @@ ElfFile<ElfFileParamNames>::ElfFile(FileContents fContents)
         memcpy(&shdr, fileContents->data() + rdi(hdr()->e_shoff) + i * sizeof(Elf_Shdr), sizeof shdr);
         shdrs.push_back(shdr);
     }
+    shdrTableRoom = shdrs.size() * sizeof(Elf_Shdr);
 
     /* Get the section header string table section (".shstrtab").  Its
        index in the section header table is given by e_shstrndx field
@@ -361,6 +746,7 @@ ElfFile<ElfFileParamNames>::ElfFile(FileContents fContents)
 
     const char *shstrtab = reinterpret_cast<const char *>(fileContents->data() + shstrtabOffset);
     checkPointer(fileContents, shstrtab, shstrtabSize);
+    fileContents->load(shstrtabOffset, shstrtabSize);
 
     if (shstrtabSize == 0)
         error("string table size is zero");
@@ -369,10 +755,26 @@ ElfFile<ElfFileParamNames>::ElfFile(FileContents fContents)
         error("string table is not zero terminated");
 
     sectionNames = std::string(shstrtab, shstrtabSize);
+    indexSections();
 
     sectionsByOldIndex.resize(shdrs.size());
-    for (size_t i = 1; i < shdrs.size(); ++i)
-        sectionsByOldIndex.at(i) = getSectionName(shdrs.at(i));
+    std::iota(sectionsByOldIndex.begin(), sectionsByOldIndex.end(), 0);
+    for (auto & shdr : shdrs)
+        sectionAddrsByOldIndex.push_back(rdi(shdr.sh_addr));
+
+    /* The ELF header is updated through hdr() all over the place; rather
+       than tracking each of those writes, it is always written back. */
+    markDirty(0, sizeof(Elf_Ehdr));
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::growFile(size_t newSize)
+{
+    auto oldSize = fileContents->size();
+    fileContents->resize(newSize, 0);
+    if (newSize > oldSize)
+        markDirty(oldSize, newSize - oldSize);
 }
 
 
@@ -418,70 +820,163 @@ void ElfFile<ElfFileParamNames>::sortPhdrs()
 template<ElfFileParams>
 void ElfFile<ElfFileParamNames>::sortShdrs()
 {
-    /* Translate sh_link mappings to section names, since sorting the
-       sections will invalidate the sh_link fields. */
-    std::map<SectionName, SectionName> linkage;
-    for (unsigned int i = 1; i < rdi(hdr()->e_shnum); ++i)
-        if (rdi(shdrs.at(i).sh_link) != 0)
-            linkage[getSectionName(shdrs.at(i))] = getSectionName(shdrs.at(rdi(shdrs.at(i).sh_link)));
+    /* Sort the sections by offset. This is done on their indices, so that
+       sh_link, sh_info and the like can be remapped in one pass afterwards
+       without having to go through the (not necessarily unique) section
+       names. */
+    const unsigned int n = shdrs.size();
+    std::vector<unsigned int> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    stable_sort(order.begin() + 1, order.end(), [&](unsigned int x, unsigned int y) {
+        return rdi(shdrs[x].sh_offset) < rdi(shdrs[y].sh_offset);
+    });
 
-    /* Idem for sh_info on certain sections. */
-    std::map<SectionName, SectionName> info;
-    for (unsigned int i = 1; i < rdi(hdr()->e_shnum); ++i)
-        if (rdi(shdrs.at(i).sh_info) != 0 &&
-            (rdi(shdrs.at(i).sh_type) == SHT_REL || rdi(shdrs.at(i).sh_type) == SHT_RELA))
-            info[getSectionName(shdrs.at(i))] = getSectionName(shdrs.at(rdi(shdrs.at(i).sh_info)));
+    if (std::is_sorted(order.begin(), order.end()))
+        return;
 
-    /* Idem for the index of the .shstrtab section in the ELF header. */
-    Elf_Shdr shstrtab = shdrs.at(rdi(hdr()->e_shstrndx));
+    std::vector<unsigned int> newIndex(n);
+    for (unsigned int i = 0; i < n; ++i)
+        newIndex[order[i]] = i;
+
+    std::vector<Elf_Shdr> sorted;
+    sorted.reserve(n);
+    for (auto i : order)
+        sorted.push_back(shdrs[i]);
+    shdrs = std::move(sorted);
+    indexSections();
+
+    /* Restore the sh_link mappings, and sh_info on relocation sections. */
+    for (unsigned int i = 1; i < n; ++i) {
+        auto & shdr = shdrs[i];
+        if (rdi(shdr.sh_link) != 0)
+            wri(shdr.sh_link, newIndex.at(rdi(shdr.sh_link)));
+        if (rdi(shdr.sh_info) != 0 &&
+            (rdi(shdr.sh_type) == SHT_REL || rdi(shdr.sh_type) == SHT_RELA))
+            wri(shdr.sh_info, newIndex.at(rdi(shdr.sh_info)));
+    }
 
-    /* Sort the sections by offset. */
-    CompShdr comp;
-    comp.elfFile = this;
-    stable_sort(shdrs.begin() + 1, shdrs.end(), comp);
+    /* And the .shstrtab index. */
+    wri(hdr()->e_shstrndx, newIndex.at(rdi(hdr()->e_shstrndx)));
 
-    /* Restore the sh_link mappings. */
-    for (unsigned int i = 1; i < rdi(hdr()->e_shnum); ++i)
-        if (rdi(shdrs[i].sh_link) != 0)
-            wri(shdrs[i].sh_link,
-                getSectionIndex(linkage[getSectionName(shdrs[i])]));
+    /* Symbols still refer to sections by the indices they had before. */
+    for (auto & i : sectionsByOldIndex)
+        i = newIndex.at(i);
+}
 
-    /* And the st_info mappings. */
-    for (unsigned int i = 1; i < rdi(hdr()->e_shnum); ++i)
-        if (rdi(shdrs.at(i).sh_info) != 0 &&
-            (rdi(shdrs.at(i).sh_type) == SHT_REL || rdi(shdrs.at(i).sh_type) == SHT_RELA))
-            wri(shdrs.at(i).sh_info,
-                getSectionIndex(info.at(getSectionName(shdrs.at(i)))));
-
-    /* And the .shstrtab index. Note: the match here is done by checking the offset as searching
-     * by name can yield incorrect results in case there are multiple sections with the same
-     * name as the one initially pointed by hdr()->e_shstrndx */
-    for (unsigned int i = 1; i < rdi(hdr()->e_shnum); ++i) {
-        if (shdrs.at(i).sh_offset == shstrtab.sh_offset) {
-            wri(hdr()->e_shstrndx, i);
+#ifndef _WIN32
+static void pwriteAll(int fd, const unsigned char * data, size_t size, size_t offset)
+{
+    size_t bytesWritten = 0;
+    while (bytesWritten < size) {
+        ssize_t portion = pwrite(fd, data + bytesWritten, size - bytesWritten, offset + bytesWritten);
+        if (portion < 0) {
+            if (errno == EINTR)
+                continue;
+            error("pwrite");
+        }
+        bytesWritten += portion;
+    }
+}
+
+
+static bool isZero(const unsigned char * data, size_t size)
+{
+    return size == 0 || (data[0] == 0 && memcmp(data, data + 1, size - 1) == 0);
+}
+
+
+static bool punchHole([[maybe_unused]] int fd, [[maybe_unused]] size_t offset, [[maybe_unused]] size_t size)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) == 0;
+#else
+    return false;
+#endif
+}
+
+
+/* Write bytes [begin, end) of 'contents' to the same offsets of the
+   regular file 'fd', whose state before writing is described by 'st'.
+   Runs of zeros covering whole blocks (such as segment alignment
+   padding) become holes instead: past the old end of the file they are
+   not written at all, before it they are punched out where the
+   filesystem supports that.  The caller has to set the final file size
+   with ftruncate(). */
+static void pwriteRange(int fd, const FileContents & contents, size_t begin, size_t end, const struct stat & st)
+{
+    const size_t blockSize = st.st_blksize > 0 ? st.st_blksize : 4096;
+    const size_t oldSize = st.st_size;
+    const unsigned char * data = contents->data();
+
+    /* Blocks at the end of the file count as whole. */
+    auto zeroBlock = [&] (size_t block) {
+        size_t blockEnd = std::min(block + blockSize, end);
+        return (blockEnd - block == blockSize || blockEnd == contents->size())
+            && isZero(data + block, blockEnd - block);
+    };
+
+    size_t dataStart = begin;
+    size_t block = (begin + blockSize - 1) / blockSize * blockSize;
+    while (block < end) {
+        if (!zeroBlock(block)) {
+            block += blockSize;
+            continue;
         }
+
+        size_t runEnd = block;
+        while (runEnd < end && zeroBlock(runEnd))
+            runEnd = std::min(runEnd + blockSize, end);
+
+        pwriteAll(fd, data + dataStart, block - dataStart, dataStart);
+        size_t punchEnd = std::min(runEnd, oldSize);
+        if (block < punchEnd && !punchHole(fd, block, punchEnd - block))
+            pwriteAll(fd, data + block, punchEnd - block, block);
+
+        dataStart = block = runEnd;
     }
+    pwriteAll(fd, data + dataStart, end - dataStart, dataStart);
 }
+#endif
+
 
 static void writeFile(const std::string & fileName, const FileContents & contents)
 {
     debug("writing %s\n", fileName.c_str());
 
-    int fd = open(fileName.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0777);
+    if (contents->isPartial())
+        error("cannot write a partially read file");
+
+    /* No O_TRUNC: 'contents' may still be a mapping of this very file, and
+       truncating it first would pull the unmodified pages out from under
+       us. Overwrite in place and set the final size afterwards instead. */
+    int fd = open(fileName.c_str(), O_CREAT | O_WRONLY | O_BINARY, 0777);
     if (fd == -1)
         error("open");
 
-    size_t bytesWritten = 0;
-    ssize_t portion;
-    while (bytesWritten < contents->size()) {
-        if ((portion = write(fd, contents->data() + bytesWritten, contents->size() - bytesWritten)) < 0) {
-            if (errno == EINTR)
-                continue;
-            error("write");
+    struct stat st;
+    bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+
+#ifndef _WIN32
+    if (regular)
+        pwriteRange(fd, contents, 0, contents->size(), st);
+    else
+#endif
+    {
+        size_t bytesWritten = 0;
+        ssize_t portion;
+        while (bytesWritten < contents->size()) {
+            if ((portion = write(fd, contents->data() + bytesWritten, contents->size() - bytesWritten)) < 0) {
+                if (errno == EINTR)
+                    continue;
+                error("write");
+            }
+            bytesWritten += portion;
         }
-        bytesWritten += portion;
     }
 
+    if (regular && ftruncate(fd, contents->size()) != 0)
+        error("ftruncate");
+
     if (close(fd) >= 0)
         return;
     /*
@@ -498,54 +993,293 @@ static void writeFile(const std::string & fileName, const FileContents & content
 }
 
 
-static uint64_t roundUp(uint64_t n, uint64_t m)
+/* Write back only the parts of 'contents' that were modified since the
+   file was read, leaving the rest of the file on disk alone; if bytes
+   were inserted, everything after them is rewritten as well.  Returns
+   false if the file cannot be updated that way (e.g. it is not a
+   regular file or its size changed underneath us), in which case the
+   caller should fall back to writeFile(). */
+static bool writeFileInPlace([[maybe_unused]] const std::string & fileName,
+    [[maybe_unused]] const FileContents & contents, [[maybe_unused]] const DirtyRanges & dirty)
 {
-    if (m == 0)
-        error("roundUp: alignment must not be zero");
-    if (n == 0)
-        return m;
-    return ((n - 1) / m + 1) * m;
+#ifndef _WIN32
+    if (contents->isPartial())
+        return false;
+
+    int fd = open(fileName.c_str(), O_WRONLY | O_BINARY);
+    if (fd == -1)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (size_t) st.st_size != dirty.originalSize()) {
+        close(fd);
+        return false;
+    }
+
+    debug("writing %s in place\n", fileName.c_str());
+
+    if (dirty.hasInserts()) {
+        /* Unmodified pages of a mapped 'contents' still read from this
+           very file, at a lower offset than they are written to.  Going
+           backwards in steps no larger than the smallest shift, nothing
+           is overwritten before it has been read. */
+        size_t step = contents->size();
+        for (auto & extent : dirty.sourceExtents())
+            if (extent.offset != extent.sourceOffset)
+                step = std::min(step, extent.offset - extent.sourceOffset);
+        for (size_t end = contents->size(); end > 0; ) {
+            size_t begin = end > step ? end - step : 0;
+            pwriteRange(fd, contents, begin, end, st);
+            end = begin;
+        }
+    } else {
+        for (auto & [begin, end] : dirty.merged())
+            pwriteRange(fd, contents, begin, end, st);
+    }
+
+    if (ftruncate(fd, contents->size()) != 0)
+        error("ftruncate");
+
+    if (close(fd) < 0 && errno != EINTR)
+        error("close");
+    return true;
+#else
+    return false;
+#endif
 }
 
 
-template<ElfFileParams>
-void ElfFile<ElfFileParamNames>::shiftFile(unsigned int extraPages, size_t startOffset, size_t extraBytes)
+#ifdef __linux__
+/* Fill 'fd' with the parts of 'srcFd' that 'dirty' says survive in the
+   result, at their new positions.  If nothing was moved the whole file
+   can share its data blocks with 'srcFd' (a reflink); otherwise, or if
+   the filesystem cannot do that, the kernel copies them without a round
+   trip through user space (and may still share blocks where it can). */
+static bool cloneFileData(int fd, int srcFd, const DirtyRanges & dirty)
 {
-    assert(startOffset >= sizeof(Elf_Ehdr));
+#ifdef FICLONE
+    if (!dirty.hasInserts() && ioctl(fd, FICLONE, srcFd) == 0)
+        return true;
+#endif
 
-    auto oldSize = fileContents->size();
-    assert(oldSize > startOffset);
+    for (auto & extent : dirty.sourceExtents()) {
+        size_t pos = extent.sourceOffset, end = extent.sourceOffset + extent.size;
+        while (pos < end) {
+            /* Only copy the data, holes in the source stay holes. */
+            size_t dataEnd = end;
+            off_t data = lseek(srcFd, pos, SEEK_DATA);
+            if (data >= 0) {
+                off_t hole = lseek(srcFd, data, SEEK_HOLE);
+                pos = data;
+                if (hole >= 0)
+                    dataEnd = std::min(dataEnd, (size_t) hole);
+            } else if (errno == ENXIO)
+                break;
 
-    /* Move the entire contents of the file after 'startOffset' by 'extraPages' pages further. */
-    unsigned int shift = extraPages * getPageSize();
-    fileContents->resize(oldSize + shift, 0);
-    memmove(fileContents->data() + startOffset + shift, fileContents->data() + startOffset, oldSize - startOffset);
-    memset(fileContents->data() + startOffset, 0, shift);
+            loff_t inOff = pos, outOff = extent.offset + (pos - extent.sourceOffset);
+            while ((size_t) inOff < dataEnd) {
+                ssize_t portion = copy_file_range(srcFd, &inOff, fd, &outOff, dataEnd - inOff, 0);
+                if (portion < 0 && errno == EINTR)
+                    continue;
+                if (portion <= 0)
+                    return false;
+            }
+            pos = std::max(pos, dataEnd);
+        }
+    }
+    return true;
+}
 
-    /* Adjust the ELF header. */
-    wri(hdr()->e_phoff, sizeof(Elf_Ehdr));
-    if (rdi(hdr()->e_shoff) >= startOffset)
-        wri(hdr()->e_shoff, rdi(hdr()->e_shoff) + shift);
 
-    /* Update the offsets in the section headers. */
-    for (int i = 1; i < rdi(hdr()->e_shnum); ++i) {
-        size_t sh_offset = rdi(shdrs.at(i).sh_offset);
-        if (sh_offset >= startOffset)
-            wri(shdrs.at(i).sh_offset, sh_offset + shift);
-    }
+/* Create a file in the directory of 'fileName' that can later be renamed
+   over it.  If the file has no name yet (O_TMPFILE), 'tmpName' is left
+   empty; it only gets one once it is complete, so a killed run leaves
+   nothing behind. */
+static int openTempFile(const std::string & fileName, std::string & tmpName)
+{
+    auto slash = fileName.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : fileName.substr(0, slash + 1);
+
+    tmpName.clear();
+#ifdef O_TMPFILE
+    int fd = open(dir.c_str(), O_TMPFILE | O_WRONLY, 0777);
+    if (fd != -1)
+        return fd;
+#endif
 
-    int splitIndex = -1;
-    size_t splitShift = 0;
+    tmpName = fileName + ".patchelf-XXXXXX";
+    return mkstemp(tmpName.data());
+}
 
-    /* Update the offsets in the program headers. */
-    for (int i = 0; i < rdi(hdr()->e_phnum); ++i) {
-        Elf_Off p_start = rdi(phdrs.at(i).p_offset);
 
-        if (p_start <= startOffset && p_start + rdi(phdrs.at(i).p_filesz) > startOffset && rdi(phdrs.at(i).p_type) == PT_LOAD) {
-            assert(splitIndex == -1);
+/* Give the anonymous file 'fd' a temporary name next to 'fileName'.
+   linkat() cannot replace an existing file, so the final step is still
+   a rename(). */
+static bool linkTempFile(int fd, const std::string & fileName, std::string & tmpName)
+{
+    std::string procPath = "/proc/self/fd/" + std::to_string(fd);
+    for (unsigned int i = 0; ; ++i) {
+        std::string name = fileName + ".patchelf-" + std::to_string(getpid()) + "-" + std::to_string(i);
+        if (linkat(AT_FDCWD, procPath.c_str(), AT_FDCWD, name.c_str(), AT_SYMLINK_FOLLOW) == 0) {
+            tmpName = name;
+            return true;
+        }
+        if (errno != EEXIST)
+            return false;
+    }
+}
+#endif
 
-            splitIndex = i;
-            splitShift = startOffset - p_start;
+
+/* Produce 'fileName' as a copy of 'sourceName' with the modified ranges
+   of 'contents' applied, sharing the unmodified data with the source
+   where the filesystem supports it.  The result is renamed into place,
+   so readers never see a half-written file; an existing file is thus
+   replaced by a new one with the same mode.  Returns false if this is
+   not possible, in which case the caller should fall back to
+   writeFile(). */
+static bool writeFileCloned([[maybe_unused]] const std::string & fileName,
+    [[maybe_unused]] const std::string & sourceName,
+    [[maybe_unused]] const FileContents & contents, [[maybe_unused]] const DirtyRanges & dirty)
+{
+#ifdef __linux__
+    if (contents->isPartial())
+        return false;
+
+    /* Writing through a symlink or into a device must keep working as
+       before, which a rename would not.  Neither would it keep the other
+       names of a hard-linked file, an owner other than us, or extended
+       attributes (including ACLs), so those are rewritten in place. */
+    struct stat outSt;
+    bool outExists = lstat(fileName.c_str(), &outSt) == 0;
+    if (outExists && (!S_ISREG(outSt.st_mode) || outSt.st_nlink > 1
+            || outSt.st_uid != geteuid() || outSt.st_gid != getegid()
+            || llistxattr(fileName.c_str(), nullptr, 0) > 0))
+        return false;
+
+    int srcFd = open(sourceName.c_str(), O_RDONLY | O_BINARY);
+    if (srcFd == -1)
+        return false;
+
+    struct stat srcSt;
+    if (fstat(srcFd, &srcSt) != 0 || !S_ISREG(srcSt.st_mode) || (size_t) srcSt.st_size != dirty.originalSize()) {
+        close(srcFd);
+        return false;
+    }
+
+    std::string tmpName;
+    int fd = openTempFile(fileName, tmpName);
+
+    /* mkstemp() creates the file with mode 0600; without an existing
+       output to take the mode from, leave the job to writeFile(), which
+       applies the umask like it always did. */
+    if (fd != -1 && !tmpName.empty() && !outExists) {
+        close(fd);
+        unlink(tmpName.c_str());
+        fd = -1;
+    }
+    if (fd == -1) {
+        close(srcFd);
+        return false;
+    }
+
+    auto discard = [&] {
+        close(fd);
+        if (!tmpName.empty())
+            unlink(tmpName.c_str());
+    };
+
+    bool cloned = cloneFileData(fd, srcFd, dirty);
+    close(srcFd);
+    if (!cloned) {
+        discard();
+        return false;
+    }
+
+    debug("writing %s from a copy of %s\n", fileName.c_str(), sourceName.c_str());
+
+    try {
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+            error("fstat");
+        for (auto & [begin, end] : dirty.merged())
+            pwriteRange(fd, contents, begin, end, st);
+        if (ftruncate(fd, contents->size()) != 0)
+            error("ftruncate");
+        if (outExists && fchmod(fd, outSt.st_mode & 07777) != 0)
+            error("fchmod");
+    } catch (...) {
+        discard();
+        throw;
+    }
+
+    if (tmpName.empty() && !linkTempFile(fd, fileName, tmpName)) {
+        discard();
+        return false;
+    }
+
+    if (rename(tmpName.c_str(), fileName.c_str()) != 0) {
+        int savedErrno = errno;
+        discard();
+        errno = savedErrno;
+        error("rename");
+    }
+
+    close(fd);
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+static uint64_t roundUp(uint64_t n, uint64_t m)
+{
+    if (m == 0)
+        error("roundUp: alignment must not be zero");
+    if (n == 0)
+        return m;
+    return ((n - 1) / m + 1) * m;
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::shiftFile(unsigned int extraPages, size_t startOffset, size_t extraBytes)
+{
+    assert(startOffset >= sizeof(Elf_Ehdr));
+
+    auto oldSize = fileContents->size();
+    assert(oldSize > startOffset);
+
+    /* Move the entire contents of the file after 'startOffset' by 'extraPages' pages further. */
+    unsigned int shift = extraPages * getPageSize();
+    fileContents->insert(startOffset, shift);
+    dirty.insert(startOffset, shift);
+
+    /* Adjust the ELF header. */
+    wri(hdr()->e_phoff, sizeof(Elf_Ehdr));
+    if (rdi(hdr()->e_shoff) >= startOffset)
+        wri(hdr()->e_shoff, rdi(hdr()->e_shoff) + shift);
+
+    /* Update the offsets in the section headers. */
+    for (int i = 1; i < rdi(hdr()->e_shnum); ++i) {
+        size_t sh_offset = rdi(shdrs.at(i).sh_offset);
+        if (sh_offset >= startOffset)
+            wri(shdrs.at(i).sh_offset, sh_offset + shift);
+    }
+
+    int splitIndex = -1;
+    size_t splitShift = 0;
+
+    /* Update the offsets in the program headers. */
+    for (int i = 0; i < rdi(hdr()->e_phnum); ++i) {
+        Elf_Off p_start = rdi(phdrs.at(i).p_offset);
+
+        if (p_start <= startOffset && p_start + rdi(phdrs.at(i).p_filesz) > startOffset && rdi(phdrs.at(i).p_type) == PT_LOAD) {
+            assert(splitIndex == -1);
+
+            splitIndex = i;
+            splitShift = startOffset - p_start;
 
             /* This is the load segment we're currently extending within, so we split it. */
             wri(phdrs.at(i).p_offset, startOffset);
@@ -591,33 +1325,44 @@ void ElfFile<ElfFileParamNames>::shiftFile(unsigned int extraPages, size_t start
 
 
 template<ElfFileParams>
-std::string ElfFile<ElfFileParamNames>::getSectionName(const Elf_Shdr & shdr) const
+std::string_view ElfFile<ElfFileParamNames>::getSectionName(const Elf_Shdr & shdr) const
 {
     const size_t name_off = rdi(shdr.sh_name);
 
     if (name_off >= sectionNames.size())
         error("section name offset out of bounds");
 
-    return std::string(sectionNames.c_str() + name_off);
+    /* .shstrtab is known to be NUL-terminated. */
+    return std::string_view(sectionNames.c_str() + name_off);
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::indexSections()
+{
+    sectionIndices.clear();
+    sectionIndices.reserve(shdrs.size());
+    for (unsigned int i = 1; i < shdrs.size(); ++i)
+        sectionIndices.emplace(getSectionName(shdrs[i]), i);
 }
 
 
 template<ElfFileParams>
-const Elf_Shdr & ElfFile<ElfFileParamNames>::findSectionHeader(const SectionName & sectionName) const
+const Elf_Shdr & ElfFile<ElfFileParamNames>::findSectionHeader(std::string_view sectionName) const
 {
     auto shdr = tryFindSectionHeader(sectionName);
     if (!shdr) {
         std::string extraMsg;
         if (sectionName == ".interp" || sectionName == ".dynamic" || sectionName == ".dynstr")
             extraMsg = ". The input file is most likely statically linked";
-        error("cannot find section '" + sectionName + "'" + extraMsg);
+        error(fmt("cannot find section '", sectionName, "'", extraMsg));
     }
     return *shdr;
 }
 
 
 template<ElfFileParams>
-std::optional<std::reference_wrapper<const Elf_Shdr>> ElfFile<ElfFileParamNames>::tryFindSectionHeader(const SectionName & sectionName) const
+std::optional<std::reference_wrapper<const Elf_Shdr>> ElfFile<ElfFileParamNames>::tryFindSectionHeader(std::string_view sectionName) const
 {
     auto i = getSectionIndex(sectionName);
     if (i)
@@ -631,6 +1376,7 @@ span<T> ElfFile<ElfFileParamNames>::getSectionSpan(const Elf_Shdr & shdr) const
 {
     auto off = rdi(shdr.sh_offset), size = rdi(shdr.sh_size);
     checkOffset(fileContents, off, size);
+    fileContents->load(off, size);
     if (off % alignof(T) != 0)
         error("section content is not naturally aligned");
     return span((T*)(fileContents->data() + off), size / sizeof(T));
@@ -645,6 +1391,38 @@ span<char> ElfFile<ElfFileParamNames>::getStrTab(const Elf_Shdr & shdr) const
     return s;
 }
 
+/* Edits are collected in replacedSections and only laid out once, by
+   rewriteSections(), so operations reading a section another operation
+   may already have replaced must see the pending copy. */
+template<ElfFileParams>
+template<class T>
+span<T> ElfFile<ElfFileParamNames>::getCurrentSectionSpan(const Elf_Shdr & shdr)
+{
+    auto i = replacedSections.find(getSectionName(shdr));
+    if (i == replacedSections.end())
+        return getSectionSpan<T>(shdr);
+    auto & contents = i->second;
+    if (reinterpret_cast<uintptr_t>(contents.data()) % alignof(T) != 0)
+        error("section content is not naturally aligned");
+    return span((T*) contents.data(), contents.size() / sizeof(T));
+}
+
+template<ElfFileParams>
+span<char> ElfFile<ElfFileParamNames>::getCurrentStrTab(const Elf_Shdr & shdr)
+{
+    auto s = getCurrentSectionSpan<char>(shdr);
+    if (s.size() == 0 || s[s.size() - 1] != '\0')
+        error("string table is not NUL-terminated");
+    return s;
+}
+
+template<ElfFileParams>
+size_t ElfFile<ElfFileParamNames>::getCurrentSectionSize(const Elf_Shdr & shdr) const
+{
+    auto i = replacedSections.find(getSectionName(shdr));
+    return i == replacedSections.end() ? rdi(shdr.sh_size) : i->second.size();
+}
+
 template<ElfFileParams>
 template<class T>
 span<T> ElfFile<ElfFileParamNames>::getSectionSpan(const SectionName & sectionName)
@@ -661,21 +1439,20 @@ span<T> ElfFile<ElfFileParamNames>::tryGetSectionSpan(const SectionName & sectio
 }
 
 template<ElfFileParams>
-unsigned int ElfFile<ElfFileParamNames>::getSectionIndex(const SectionName & sectionName) const
+unsigned int ElfFile<ElfFileParamNames>::getSectionIndex(std::string_view sectionName) const
 {
-    for (unsigned int i = 1; i < rdi(hdr()->e_shnum); ++i)
-        if (getSectionName(shdrs.at(i)) == sectionName) return i;
-    return 0;
+    auto i = sectionIndices.find(sectionName);
+    return i == sectionIndices.end() ? 0 : i->second;
 }
 
 template<ElfFileParams>
-bool ElfFile<ElfFileParamNames>::hasReplacedSection(const SectionName & sectionName) const
+bool ElfFile<ElfFileParamNames>::hasReplacedSection(std::string_view sectionName) const
 {
     return replacedSections.count(sectionName);
 }
 
 template<ElfFileParams>
-bool ElfFile<ElfFileParamNames>::canReplaceSection(const SectionName & sectionName) const
+bool ElfFile<ElfFileParamNames>::canReplaceSection(std::string_view sectionName) const
 {
     auto shdr = findSectionHeader(sectionName);
 
@@ -686,26 +1463,106 @@ template<ElfFileParams>
 std::string & ElfFile<ElfFileParamNames>::replaceSection(const SectionName & sectionName,
     unsigned int size)
 {
+    /* Edit the pending copy in place; the first time round, read only the
+       bytes of the old section that survive the resize. */
     auto i = replacedSections.find(sectionName);
-    std::string s;
 
-    if (i != replacedSections.end()) {
-        s = std::string(i->second);
-    } else {
+    if (i == replacedSections.end()) {
         auto shdr = findSectionHeader(sectionName);
-        s = extractString(fileContents, rdi(shdr.sh_offset), rdi(shdr.sh_size));
+        i = replacedSections.emplace(sectionName, extractString(fileContents,
+            rdi(shdr.sh_offset), std::min<size_t>(size, rdi(shdr.sh_size)))).first;
+    }
+
+    i->second.resize(size);
+
+    return i->second;
+}
+
+
+template<ElfFileParams>
+size_t ElfFile<ElfFileParamNames>::addString(const SectionName & sectionName, std::string_view s)
+{
+    return addStrings(sectionName, {s}).front();
+}
+
+template<ElfFileParams>
+std::vector<size_t> ElfFile<ElfFileParamNames>::addStrings(const SectionName & sectionName, const std::vector<std::string_view> & strs)
+{
+    auto strTab = getCurrentStrTab(findSectionHeader(sectionName));
+    auto strAt = [&](size_t offset) { return std::string_view(&strTab[offset]); };
+    auto byTail = [&](std::string_view x, std::string_view y) {
+        return std::lexicographical_compare(x.rbegin(), x.rend(), y.rbegin(), y.rend());
+    };
+    auto byTailAt = [&](size_t x, size_t y) { return byTail(strAt(x), strAt(y)); };
+
+    /* Index whatever was added to the table since the last call. */
+    auto & index = strTabIndices[sectionName];
+    if (index.size > strTab.size())
+        index = {};
+    if (index.size < strTab.size()) {
+        auto indexed = index.byTail.size();
+        for (size_t offset = index.size; offset < strTab.size(); offset += strAt(offset).size() + 1) {
+            index.byHash.emplace(std::hash<std::string_view>()(strAt(offset)), offset);
+            index.byTail.push_back(offset);
+        }
+        std::sort(index.byTail.begin() + indexed, index.byTail.end(), byTailAt);
+        std::inplace_merge(index.byTail.begin(), index.byTail.begin() + indexed, index.byTail.end(), byTailAt);
+        index.size = strTab.size();
     }
 
-    s.resize(size);
-    replacedSections[sectionName] = s;
+    auto find = [&](std::string_view s) -> std::optional<size_t> {
+        auto [first, last] = index.byHash.equal_range(std::hash<std::string_view>()(s));
+        for (auto i = first; i != last; ++i)
+            if (strAt(i->second) == s)
+                return i->second;
+
+        /* Strings that 's' is the tail of come first among those not
+           ordered before it. */
+        auto i = std::lower_bound(index.byTail.begin(), index.byTail.end(), s,
+            [&](size_t x, std::string_view y) { return byTail(strAt(x), y); });
+        if (i != index.byTail.end()) {
+            auto str = strAt(*i);
+            if (str.size() > s.size() && str.compare(str.size() - s.size(), s.size(), s) == 0) {
+                debug("reusing the tail of '%s' in %s\n", str.data(), sectionName.c_str());
+                return *i + str.size() - s.size();
+            }
+        }
+        return {};
+    };
+
+    /* The new strings are indexed by the next call; until then the ones
+       added here are only shared among themselves when equal. */
+    std::vector<size_t> offsets;
+    offsets.reserve(strs.size());
+    std::string added;
+    std::unordered_map<std::string_view, size_t> addedAt;
+    for (auto s : strs) {
+        if (auto offset = find(s)) {
+            offsets.push_back(*offset);
+            continue;
+        }
+        auto [i, inserted] = addedAt.emplace(s, strTab.size() + added.size());
+        if (inserted) {
+            debug("adding '%s' to %s\n", std::string(s).c_str(), sectionName.c_str());
+            added.append(s);
+            added += '\0';
+        }
+        offsets.push_back(i->second);
+    }
 
-    return replacedSections[sectionName];
+    if (!added.empty()) {
+        size_t size = strTab.size();
+        auto replaced = replacedSections.find(sectionName);
+        std::string & table = replaced != replacedSections.end() ? replaced->second : replaceSection(sectionName, size);
+        table += added;
+    }
+    return offsets;
 }
 
 
 template<ElfFileParams>
 void ElfFile<ElfFileParamNames>::writeReplacedSections(Elf_Off & curOff,
-    Elf_Addr startAddr, Elf_Off startOffset)
+    Elf_Addr startAddr, Elf_Off startOffset, const Placements & placements)
 {
     if (clobberOldSections) {
         /* Overwrite the old section contents with 'Z's.  Do this
@@ -717,6 +1574,7 @@ void ElfFile<ElfFileParamNames>::writeReplacedSections(Elf_Off & curOff,
             if (rdi(shdr.sh_type) != SHT_NOBITS) {
                 checkOffset(fileContents, rdi(shdr.sh_offset), rdi(shdr.sh_size));
                 memset(fileContents->data() + rdi(shdr.sh_offset), 'Z', rdi(shdr.sh_size));
+                markDirty(shdr);
             }
         }
     }
@@ -726,22 +1584,30 @@ void ElfFile<ElfFileParamNames>::writeReplacedSections(Elf_Off & curOff,
     /* We iterate over the sorted section headers here, so that the relative
        position between replaced sections stays the same.  */
     for (auto & shdr : shdrs) {
-        std::string sectionName = getSectionName(shdr);
-        auto i = replacedSections.find(sectionName);
+        auto i = replacedSections.find(getSectionName(shdr));
         if (i == replacedSections.end())
             continue;
+        const std::string & sectionName = i->first;
+
+        /* Sections for which placeInFreeSpace() found room go there,
+           the others one after the other from curOff. */
+        auto placement = placements.find(sectionName);
+        bool placed = placement != placements.end();
+        Elf_Off offset = placed ? placement->second.offset : curOff;
+        Elf_Addr addr = placed ? placement->second.addr : startAddr + (curOff - startOffset);
 
         Elf_Shdr orig_shdr = shdr;
         debug("rewriting section '%s' from offset 0x%x (size %d) to offset 0x%x (size %d)\n",
-            sectionName.c_str(), rdi(shdr.sh_offset), rdi(shdr.sh_size), curOff, i->second.size());
+            sectionName.c_str(), rdi(shdr.sh_offset), rdi(shdr.sh_size), offset, i->second.size());
 
-        checkOffset(fileContents, curOff, i->second.size());
-        memcpy(fileContents->data() + curOff, i->second.c_str(),
+        checkOffset(fileContents, offset, i->second.size());
+        memcpy(fileContents->data() + offset, i->second.c_str(),
             i->second.size());
+        markDirty(offset, i->second.size());
 
         /* Update the section header for this section. */
-        wri(shdr.sh_offset, curOff);
-        wri(shdr.sh_addr, startAddr + (curOff - startOffset));
+        wri(shdr.sh_offset, offset);
+        wri(shdr.sh_addr, addr);
         wri(shdr.sh_size, i->second.size());
         wri(shdr.sh_addralign, sectionAlignment);
 
@@ -832,7 +1698,8 @@ void ElfFile<ElfFileParamNames>::writeReplacedSections(Elf_Off & curOff,
             }
         }
 
-        curOff += roundUp(i->second.size(), sectionAlignment);
+        if (!placed)
+            curOff += roundUp(i->second.size(), sectionAlignment);
     }
 
     replacedSections.clear();
@@ -840,29 +1707,204 @@ void ElfFile<ElfFileParamNames>::writeReplacedSections(Elf_Off & curOff,
 
 
 template<ElfFileParams>
-void ElfFile<ElfFileParamNames>::rewriteSectionsLibrary()
+auto ElfFile<ElfFileParamNames>::placeInFreeSpace(Elf_Off reservedEnd) -> Placements
 {
-    /* For dynamic libraries, we just place the replacement sections
-       at the end of the file.  They're mapped into memory by a
-       PT_LOAD segment located directly after the last virtual address
-       page of other segments. */
-    Elf_Addr startPage = 0;
-    Elf_Addr firstPage = 0;
-    unsigned alignStartPage = getPageSize();
+    /* Replaced sections leave their old copies behind as dead space.
+       Where that space is mapped by a PT_LOAD segment, a replacement
+       that fits can be put back there instead of growing the file and
+       mapping it with another segment.  The last segment in the file
+       may also simply grow if its end is dead.  Bytes up to reservedEnd
+       past e_phoff are kept free for the program header table. */
+    Placements placements;
+
+    /* Without clobbering, the old copies have to stay readable. */
+    if (!clobberOldSections) return placements;
+
+    using Range = std::pair<Elf_Off, Elf_Off>; /* [begin, end) */
+
+    const Elf_Off fileSize = fileContents->size();
+    auto range = [&](Elf_Off offset, Elf_Off size) {
+        offset = std::min(offset, fileSize);
+        return Range(offset, offset + std::min(size, fileSize - offset));
+    };
+
+    std::vector<Range> dead, live;
+    std::set<std::string_view> duplicated;
+
+    for (unsigned int i = 1; i < shdrs.size(); ++i) {
+        const auto & shdr = shdrs.at(i);
+        auto sectionName = getSectionName(shdr);
+        bool replaced = hasReplacedSection(sectionName);
+
+        /* writeReplacedSections() gives every section of a replaced name
+           the same contents; leave those to the end of the file. */
+        if (replaced && getSectionIndex(sectionName) != i) {
+            duplicated.insert(sectionName);
+            replaced = false;
+        }
+
+        if (rdi(shdr.sh_type) == SHT_NOBITS) continue;
+        (replaced ? dead : live).push_back(range(rdi(shdr.sh_offset), rdi(shdr.sh_size)));
+    }
+
+    live.emplace_back(0, sizeof(Elf_Ehdr));
+    live.push_back(range(rdi(hdr()->e_phoff),
+        std::max<Elf_Off>(reservedEnd - rdi(hdr()->e_phoff), phdrs.size() * sizeof(Elf_Phdr))));
+    live.push_back(range(rdi(hdr()->e_shoff), rdi(hdr()->e_shnum) * sizeof(Elf_Shdr)));
+
+    std::vector<Range> relro;
+    Elf_Addr lastAddr = 0;
     for (auto & phdr : phdrs) {
-        Elf_Addr thisPage = rdi(phdr.p_vaddr) + rdi(phdr.p_memsz);
-        if (thisPage > startPage) startPage = thisPage;
-        if (rdi(phdr.p_type) == PT_PHDR) firstPage = rdi(phdr.p_vaddr) - rdi(phdr.p_offset);
-        unsigned thisAlign = rdi(phdr.p_align);
-        alignStartPage = std::max(alignStartPage, thisAlign);
+        lastAddr = std::max<Elf_Addr>(lastAddr, rdi(phdr.p_vaddr) + rdi(phdr.p_memsz));
+        switch (rdi(phdr.p_type)) {
+        case PT_GNU_RELRO:
+            relro.push_back(range(rdi(phdr.p_offset), rdi(phdr.p_filesz)));
+            break;
+        case PT_LOAD:
+        case PT_PHDR:
+        case PT_GNU_STACK:
+        /* These follow the section they map, see writeReplacedSections(). */
+        case PT_INTERP:
+        case PT_DYNAMIC:
+        case PT_NOTE:
+        case PT_MIPS_ABIFLAGS:
+        case PT_GNU_PROPERTY:
+            break;
+        default:
+            live.push_back(range(rdi(phdr.p_offset), rdi(phdr.p_filesz)));
+        }
     }
-    if (alignStartPage > maxSegmentAlignment)
-        error("segment alignment is implausibly large; refusing to grow file");
 
-    startPage = roundUp(startPage, alignStartPage);
+    /* Subtract everything still in use from the dead ranges. */
+    std::sort(dead.begin(), dead.end());
+    std::sort(live.begin(), live.end());
 
-    debug("last page is 0x%llx\n", (unsigned long long) startPage);
-    debug("first page is 0x%llx\n", (unsigned long long) firstPage);
+    std::vector<Range> merged;
+    for (auto [begin, end] : dead) {
+        if (!merged.empty() && begin <= merged.back().second) {
+            merged.back().second = std::max(merged.back().second, end);
+            continue;
+        }
+        merged.emplace_back(begin, end);
+    }
+    std::vector<Range> unused;
+    for (auto [begin, end] : merged) {
+        for (auto & [liveBegin, liveEnd] : live) {
+            if (liveEnd <= begin || liveBegin >= end) continue;
+            if (liveBegin > begin) unused.emplace_back(begin, liveBegin);
+            begin = std::max(begin, liveEnd);
+            if (begin >= end) break;
+        }
+        if (begin < end) unused.emplace_back(begin, end);
+    }
+
+    auto inRelro = [&](Elf_Off begin, Elf_Off end) {
+        return std::any_of(relro.begin(), relro.end(),
+            [&](const Range & r) { return begin < r.second && r.first < end; });
+    };
+
+    /* The last segment can grow if nothing but dead space follows it,
+       in memory or in the file, as with sections appended by an earlier
+       run. */
+    Elf_Phdr * tail = nullptr;
+    for (auto & phdr : phdrs)
+        if (rdi(phdr.p_type) == PT_LOAD &&
+            (!tail || rdi(phdr.p_offset) + rdi(phdr.p_filesz) > rdi(tail->p_offset) + rdi(tail->p_filesz)))
+            tail = &phdr;
+    if (tail) {
+        Elf_Off segEnd = rdi(tail->p_offset) + rdi(tail->p_filesz);
+        if (rdi(tail->p_flags) != (PF_R | PF_W) ||
+            rdi(tail->p_filesz) != rdi(tail->p_memsz) ||
+            rdi(tail->p_vaddr) + rdi(tail->p_memsz) != lastAddr ||
+            segEnd > fileSize ||
+            std::any_of(live.begin(), live.end(),
+                [&](const Range & r) { return r.first < r.second && r.second > segEnd; }))
+            tail = nullptr;
+    }
+
+    struct Extent
+    {
+        Elf_Off begin, end;
+        const Elf_Phdr * segment;
+        bool relro, growable;
+    };
+    std::vector<Extent> extents;
+
+    for (auto & phdr : phdrs) {
+        if (rdi(phdr.p_type) != PT_LOAD) continue;
+        Elf_Off segBegin = rdi(phdr.p_offset);
+        Elf_Off segEnd = segBegin + rdi(phdr.p_filesz);
+        for (auto [begin, end] : unused) {
+            begin = std::max(begin, segBegin);
+            end = std::min(end, segEnd);
+            if (begin < end)
+                extents.push_back({begin, end, &phdr, inRelro(begin, end), &phdr == tail && end == segEnd});
+        }
+        if (&phdr == tail && (extents.empty() || !extents.back().growable))
+            extents.push_back({segEnd, segEnd, &phdr, false, true});
+    }
+
+    /* Best fit, in section header order; the growable tail comes last. */
+    Elf_Off tailEnd = 0;
+    for (unsigned int i = 1; i < shdrs.size(); ++i) {
+        const auto & shdr = shdrs.at(i);
+        auto sectionName = getSectionName(shdr);
+        auto it = replacedSections.find(sectionName);
+        if (it == replacedSections.end() || duplicated.count(sectionName)) continue;
+
+        const size_t size = it->second.size();
+        const auto flags = rdi(shdr.sh_flags);
+        const bool alloc = flags & SHF_ALLOC;
+        const bool wasRelro = inRelro(rdi(shdr.sh_offset), rdi(shdr.sh_offset) + rdi(shdr.sh_size));
+
+        Extent * best = nullptr;
+        for (auto & e : extents) {
+            if (alloc) {
+                auto segFlags = rdi(e.segment->p_flags);
+                if ((flags & SHF_WRITE) && !(segFlags & PF_W)) continue;
+                if ((flags & SHF_EXECINSTR) && !(segFlags & PF_X)) continue;
+                /* Memory that turns read-only after relocation is no
+                   place for anything that did not live there already. */
+                if (e.relro && !wasRelro) continue;
+            }
+            Elf_Off begin = roundUp(e.begin, sectionAlignment);
+            if (!e.growable && (begin > e.end || size > e.end - begin)) continue;
+            if (!best || (best->growable && !e.growable) ||
+                (best->growable == e.growable && e.end - e.begin < best->end - best->begin))
+                best = &e;
+        }
+        if (!best) continue;
+
+        Elf_Off offset = roundUp(best->begin, sectionAlignment);
+        const auto & seg = *best->segment;
+        placements[it->first] = {offset, rdi(seg.p_vaddr) + (offset - rdi(seg.p_offset))};
+        debug("placing section '%s' in free space at offset 0x%x\n", it->first.c_str(), offset);
+
+        best->begin = offset + size;
+        if (best->growable) {
+            best->end = std::max(best->end, best->begin);
+            tailEnd = std::max(tailEnd, best->end);
+        }
+    }
+
+    if (tail && tailEnd > rdi(tail->p_offset) + rdi(tail->p_filesz)) {
+        wri(tail->p_filesz, wri(tail->p_memsz, tailEnd - rdi(tail->p_offset)));
+        if (tailEnd + binutilsQuirkPadding > fileSize)
+            growFile(tailEnd + binutilsQuirkPadding);
+    }
+
+    return placements;
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::rewriteSectionsLibrary()
+{
+    /* For dynamic libraries, we place the replacement sections in the
+       space their old copies leave behind if they fit there, and at the
+       end of the file otherwise.  The latter are mapped into memory by a
+       PT_LOAD segment located directly after the last virtual address
+       page of other segments. */
 
     /* When normalizing note segments we will in the worst case be adding
        1 program header for each SHT_NOTE section. */
@@ -910,31 +1952,66 @@ void ElfFile<ElfFileParamNames>::rewriteSectionsLibrary()
             const auto sectionSize = rdi(shdrs.at(i).sh_size);
 
             if (!hasReplacedSection(sectionName)) {
-                replaceSection(sectionName, sectionSize);
+                replaceSection(SectionName(sectionName), sectionSize);
             }
         }
     }
 
+    Placements placements = placeInFreeSpace(relocatePht ? rdi(hdr()->e_phoff) : phtEnd);
+
+    /* The section header table can stay where it is unless it has grown
+       or is in the way of the program header table. */
+    bool relocateSht = rdi(hdr()->e_shnum) * sizeof(Elf_Shdr) > shdrTableRoom ||
+        (!relocatePht && (off_t) rdi(hdr()->e_shoff) < phtEnd &&
+         rdi(hdr()->e_shoff) + shdrTableRoom > rdi(hdr()->e_phoff));
+
+    Elf_Addr startPage = 0;
+    Elf_Addr firstPage = 0;
+    unsigned alignStartPage = getPageSize();
+    for (auto & phdr : phdrs) {
+        Elf_Addr thisPage = rdi(phdr.p_vaddr) + rdi(phdr.p_memsz);
+        if (thisPage > startPage) startPage = thisPage;
+        if (rdi(phdr.p_type) == PT_PHDR) firstPage = rdi(phdr.p_vaddr) - rdi(phdr.p_offset);
+        unsigned thisAlign = rdi(phdr.p_align);
+        alignStartPage = std::max(alignStartPage, thisAlign);
+    }
+    if (alignStartPage > maxSegmentAlignment)
+        error("segment alignment is implausibly large; refusing to grow file");
+
+    startPage = roundUp(startPage, alignStartPage);
+
+    debug("last page is 0x%llx\n", (unsigned long long) startPage);
+    debug("first page is 0x%llx\n", (unsigned long long) firstPage);
+
     /* Calculate how much space we'll need. */
-    off_t neededSpace = shtSize;
+    off_t neededSpace = 0;
+
+    if (relocateSht) {
+        neededSpace += shtSize;
+    }
 
     if (relocatePht) {
         neededSpace += phtSize;
     }
 
     for (auto & s : replacedSections)
-        neededSpace += roundUp(s.second.size(), sectionAlignment);
+        if (!placements.count(s.first))
+            neededSpace += roundUp(s.second.size(), sectionAlignment);
 
     debug("needed space is %d\n", neededSpace);
 
-    Elf_Off startOffset = roundUp(fileContents->size(), alignStartPage);
+    /* Everything fit into the existing segments. */
+    if (neededSpace == 0) {
+        normalizeNoteSegments();
+        Elf_Off curOff = 0;
+        writeReplacedSections(curOff, 0, 0, placements);
+        rewriteHeaders(firstPage + rdi(hdr()->e_phoff));
+        return;
+    }
 
-    // In older version of binutils (2.30), readelf would check if the dynamic
-    // section segment is strictly smaller than the file (and not same size).
-    // By making it one byte larger, we don't break readelf.
-    off_t binutilsQuirkPadding = 1;
+    Elf_Off startOffset = roundUp(fileContents->size(), alignStartPage);
 
-    fileContents->resize(startOffset + neededSpace + binutilsQuirkPadding, 0);
+    growFile(startOffset + neededSpace + binutilsQuirkPadding);
 
     Elf_Addr lastSegAddr = 0;
 
@@ -989,16 +2066,19 @@ void ElfFile<ElfFileParamNames>::rewriteSectionsLibrary()
 
     // ---
 
-    debug("rewriting sht from offset 0x%x to offset 0x%x (size %d)\n",
-        rdi(hdr()->e_shoff), curOff, shtSize);
+    if (relocateSht) {
+        debug("rewriting sht from offset 0x%x to offset 0x%x (size %d)\n",
+            rdi(hdr()->e_shoff), curOff, shtSize);
 
-    wri(hdr()->e_shoff, curOff);
-    curOff += shtSize;
+        wri(hdr()->e_shoff, curOff);
+        curOff += shtSize;
+        shdrTableRoom = shtSize;
+    }
 
     // ---
 
     /* Write out the replaced sections. */
-    writeReplacedSections(curOff, startPage, startOffset);
+    writeReplacedSections(curOff, startPage, startOffset, placements);
     assert(curOff == startOffset + neededSpace);
 
     /* Write out the updated program and section headers */
@@ -1023,9 +2103,9 @@ void ElfFile<ElfFileParamNames>::rewriteSectionsExecutable()
     /* What is the index of the last replaced section? */
     unsigned int lastReplaced = 0;
     for (unsigned int i = 1; i < rdi(hdr()->e_shnum); ++i) {
-        std::string sectionName = getSectionName(shdrs.at(i));
+        auto sectionName = getSectionName(shdrs.at(i));
         if (replacedSections.count(sectionName)) {
-            debug("using replaced section '%s'\n", sectionName.c_str());
+            debug("using replaced section '%s'\n", sectionName.data());
             lastReplaced = i;
         }
     }
@@ -1044,7 +2124,7 @@ void ElfFile<ElfFileParamNames>::rewriteSectionsExecutable()
     std::string prevSection;
     for (unsigned int i = 1; i <= lastReplaced; ++i) {
         Elf_Shdr & shdr(shdrs.at(i));
-        std::string sectionName = getSectionName(shdr);
+        SectionName sectionName(getSectionName(shdr));
         debug("looking at section '%s'\n", sectionName.c_str());
         /* !!! Why do we stop after a .dynstr section? I can't
            remember! */
@@ -1076,7 +2156,7 @@ void ElfFile<ElfFileParamNames>::rewriteSectionsExecutable()
            before proceeding. */
         off_t shoffNew = fileContents->size();
         off_t shSize = rdi(hdr()->e_shoff) + rdi(hdr()->e_shnum) * rdi(hdr()->e_shentsize);
-        fileContents->resize(fileContents->size() + shSize, 0);
+        growFile(fileContents->size() + shSize);
         wri(hdr()->e_shoff, shoffNew);
 
         /* Rewrite the section header table.  For neatness, keep the
@@ -1085,6 +2165,7 @@ void ElfFile<ElfFileParamNames>::rewriteSectionsExecutable()
         sortShdrs();
         for (unsigned int i = 1; i < rdi(hdr()->e_shnum); ++i)
             * ((Elf_Shdr *) (fileContents->data() + rdi(hdr()->e_shoff)) + i) = shdrs.at(i);
+        markDirty(rdi(hdr()->e_shoff), rdi(hdr()->e_shnum) * sizeof(Elf_Shdr));
     }
 
 
@@ -1183,6 +2264,7 @@ void ElfFile<ElfFileParamNames>::rewriteSectionsExecutable()
         error("section offsets are inconsistent with file size");
     debug("clearing first %d bytes\n", startOffset - curOff);
     memset(fileContents->data() + curOff, 0, startOffset - curOff);
+    markDirty(curOff, startOffset - curOff);
 
     /* Write out the replaced sections. */
     writeReplacedSections(curOff, firstPage, 0);
@@ -1267,7 +2349,8 @@ template<ElfFileParams>
 void ElfFile<ElfFileParamNames>::rewriteSections(bool force)
 {
 
-    if (!force && replacedSections.empty()) return;
+    if (!force && !forceRewrite && replacedSections.empty()) return;
+    forceRewrite = false;
 
     for (auto & i : replacedSections)
         debug("replacing section '%s' with size %d\n",
@@ -1307,6 +2390,7 @@ void ElfFile<ElfFileParamNames>::rewriteHeaders(Elf_Addr phdrAddress)
     checkOffset(fileContents, phoff, phdrs.size() * sizeof(Elf_Phdr));
     for (unsigned int i = 0; i < phdrs.size(); ++i)
         memcpy(fileContents->data() + phoff + i * sizeof(Elf_Phdr), &phdrs.at(i), sizeof(Elf_Phdr));
+    markDirty(phoff, phdrs.size() * sizeof(Elf_Phdr));
 
 
     /* Rewrite the section header table.  For neatness, keep the
@@ -1319,6 +2403,7 @@ void ElfFile<ElfFileParamNames>::rewriteHeaders(Elf_Addr phdrAddress)
     checkOffset(fileContents, shoff, shdrs.size() * sizeof(Elf_Shdr));
     for (unsigned int i = 1; i < shdrs.size(); ++i)
         memcpy(fileContents->data() + shoff + i * sizeof(Elf_Shdr), &shdrs.at(i), sizeof(Elf_Shdr));
+    markDirty(shoff, shdrs.size() * sizeof(Elf_Shdr));
 
 
     /* Update all those nasty virtual addresses in the .dynamic
@@ -1328,6 +2413,7 @@ void ElfFile<ElfFileParamNames>::rewriteHeaders(Elf_Addr phdrAddress)
     if (shdrDynamic) {
         auto dynSpan = getSectionSpan<Elf_Dyn>(*shdrDynamic);
         auto dyn_table = dynSpan.begin();
+        markDirty(*shdrDynamic);
         unsigned int d_tag;
         for (auto dyn = dyn_table; dyn < dynSpan.end() && (d_tag = rdi(dyn->d_tag)) != DT_NULL; dyn++)
             if (d_tag == DT_STRTAB)
@@ -1422,7 +2508,7 @@ void ElfFile<ElfFileParamNames>::rewriteHeaders(Elf_Addr phdrAddress)
                        is broken, and it's not our job to fix it; yet, we have
                        to find some location for dynamic loader to write the
                        debug pointer to; well, let's write it right here */
-                    fprintf(stderr, "warning: DT_MIPS_RLD_MAP_REL entry is present, but .rld_map section is not\n");
+                    fprintf(errStream, "warning: DT_MIPS_RLD_MAP_REL entry is present, but .rld_map section is not\n");
                     wri(dyn->d_un.d_ptr, 0);
                 }
             }
@@ -1432,41 +2518,81 @@ void ElfFile<ElfFileParamNames>::rewriteHeaders(Elf_Addr phdrAddress)
     /* Rewrite the .dynsym section.  It contains the indices of the
        sections in which symbols appear, so these need to be
        remapped. */
+    remapSymbolSections();
+
+    /* The symbol table now stores the section indices we just wrote, so the
+       old-index map must follow suit. Otherwise a second rewriteHeaders() in
+       the same run (e.g. removeResolutionCache() followed by a section-growing
+       edit) would remap the already-updated indices a second time through a
+       stale map and corrupt st_shndx. */
+    sectionsByOldIndex.resize(shdrs.size());
+    std::iota(sectionsByOldIndex.begin(), sectionsByOldIndex.end(), 0);
+    sectionAddrsByOldIndex.clear();
+    for (auto & shdr : shdrs)
+        sectionAddrsByOldIndex.push_back(rdi(shdr.sh_addr));
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::remapSymbolSections()
+{
+    /* Where each section that the symbols refer to has ended up, and its
+       address for STT_SECTION symbols. Symbols in unnamed sections are
+       left alone. */
+    constexpr unsigned int unnamed = std::numeric_limits<unsigned int>::max();
+    struct Target { unsigned int index; Elf_Addr addr; };
+    std::vector<Target> targets(sectionsByOldIndex.size());
+    bool sameIndices = true, sameAddrs = true;
+    for (unsigned int i = 1; i < targets.size(); ++i) {
+        auto newIndex = sectionsByOldIndex[i];
+        auto & shdr = shdrs.at(newIndex);
+        targets[i] = {newIndex != 0 && getSectionName(shdr).empty() ? unnamed : newIndex, rdi(shdr.sh_addr)};
+        sameIndices = sameIndices && targets[i].index == i;
+        sameAddrs = sameAddrs && targets[i].addr == sectionAddrsByOldIndex.at(i);
+    }
+    if (sameIndices && sameAddrs) {
+        debug("sections have not moved, leaving the symbol tables alone\n");
+        return;
+    }
+
     for (unsigned int i = 1; i < rdi(hdr()->e_shnum); ++i) {
         auto &shdr = shdrs.at(i);
         if (rdi(shdr.sh_type) != SHT_SYMTAB && rdi(shdr.sh_type) != SHT_DYNSYM) continue;
         debug("rewriting symbol table section %d\n", i);
-        for (auto & sym : getSectionSpan<Elf_Sym>(shdr)) {
-            unsigned int shndx = rdi(sym.st_shndx);
-            if (shndx != SHN_UNDEF && shndx < SHN_LORESERVE) {
-                if (shndx >= sectionsByOldIndex.size()) {
-                    fprintf(stderr, "warning: entry %d in symbol table refers to a non-existent section, skipping\n", shndx);
+        auto syms = getSectionSpan<Elf_Sym>(shdr);
+
+        /* If only addresses changed, only the STT_SECTION symbols need
+           updating, and those are local, so they come before sh_info. */
+        if (sameIndices && rdi(shdr.sh_info) < syms.size())
+            syms = span<Elf_Sym>(syms.begin(), rdi(shdr.sh_info));
+        markDirty(rdi(shdr.sh_offset), syms.size() * sizeof(Elf_Sym));
+
+        /* The entries that cannot be remapped are collected per part, to
+           be reported in order. */
+        std::vector<std::vector<unsigned int>> skipped(symbolParts(syms.size()));
+        forSymbolParts(syms.size(), [&](size_t part, size_t begin, size_t end) {
+            for (auto * sym = syms.begin() + begin; sym < syms.begin() + end; ++sym) {
+                unsigned int shndx = rdi(sym->st_shndx);
+                if (shndx == SHN_UNDEF || shndx >= SHN_LORESERVE) continue;
+                if (shndx >= targets.size() || targets[shndx].index == unnamed) {
+                    skipped[part].push_back(shndx);
                     continue;
                 }
-                const std::string & section = sectionsByOldIndex.at(shndx);
-                if (section.empty()) {
-                    fprintf(stderr, "warning: symbol table entry refers to an unnamed section (index %d), skipping\n", shndx);
-                    continue;
-                }
-                auto newIndex = getSectionIndex(section); // inefficient
-                //debug("rewriting symbol %d: index = %d (%s) -> %d\n", entry, shndx, section.c_str(), newIndex);
-                wri(sym.st_shndx, newIndex);
+                wri(sym->st_shndx, targets[shndx].index);
                 /* Rewrite st_value.  FIXME: we should do this for all
                    types, but most don't actually change. */
-                if (ELF32_ST_TYPE(rdi(sym.st_info)) == STT_SECTION)
-                    wri(sym.st_value, rdi(shdrs.at(newIndex).sh_addr));
+                if (ELF32_ST_TYPE(rdi(sym->st_info)) == STT_SECTION)
+                    wri(sym->st_value, targets[shndx].addr);
             }
-        }
-    }
+        });
 
-    /* The symbol table now stores the section indices we just wrote, so the
-       old-index map must follow suit. Otherwise a second rewriteHeaders() in
-       the same run (e.g. removeResolutionCache() followed by a section-growing
-       edit) would remap the already-updated indices a second time through a
-       stale map and corrupt st_shndx. */
-    sectionsByOldIndex.resize(shdrs.size());
-    for (size_t i = 1; i < shdrs.size(); ++i)
-        sectionsByOldIndex.at(i) = getSectionName(shdrs.at(i));
+        for (auto & part : skipped)
+            for (auto shndx : part)
+                if (shndx >= targets.size())
+                    fprintf(errStream, "warning: entry %d in symbol table refers to a non-existent section, skipping\n", shndx);
+                else
+                    fprintf(errStream, "warning: symbol table entry refers to an unnamed section (index %d), skipping\n", shndx);
+    }
 }
 
 
@@ -1491,11 +2617,22 @@ unsigned int ElfFile<ElfFileParamNames>::dynNullIndex(const std::string & newDyn
 }
 
 
-static void setSubstr(std::string & s, unsigned int pos, const std::string & t)
+/* Grow .dynamic by 'count' entries and put 'entries' at the top. Everything
+   up to and including DT_NULL moves down within the replaced buffer itself,
+   so no copy of the table is made. */
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::insertDynEntries(const Elf_Dyn * entries, size_t count)
 {
-    if (pos > s.size() || t.size() > s.size() - pos)
-        error("setSubstr: write extends past end of section");
-    copy(t.begin(), t.end(), s.begin() + pos);
+    auto shdrDynamic = findSectionHeader(".dynamic");
+    std::string & newDynamic = replaceSection(".dynamic",
+        getCurrentSectionSize(shdrDynamic) + count * sizeof(Elf_Dyn));
+
+    unsigned int idx = dynNullIndex(newDynamic);
+    if ((idx + 1 + count) * sizeof(Elf_Dyn) > newDynamic.size())
+        error(".dynamic section has no DT_NULL terminator");
+
+    memmove(newDynamic.data() + count * sizeof(Elf_Dyn), newDynamic.data(), (idx + 1) * sizeof(Elf_Dyn));
+    memcpy(newDynamic.data(), entries, count * sizeof(Elf_Dyn));
 }
 
 
@@ -1516,19 +2653,19 @@ void ElfFile<ElfFileParamNames>::modifyOsAbi(osAbiMode op, const std::string & n
 
     if (op == printOsAbi) {
         switch (abi) {
-            case 0:  printf("System V\n"); break;
-            case 1:  printf("HP-UX\n"); break;
-            case 2:  printf("NetBSD\n"); break;
-            case 3:  printf("Linux\n"); break;
-            case 4:  printf("GNU Hurd\n"); break;
-            case 6:  printf("Solaris\n"); break;
-            case 7:  printf("AIX\n"); break;
-            case 8:  printf("IRIX\n"); break;
-            case 9:  printf("FreeBSD\n"); break;
-            case 10: printf("Tru64\n"); break;
-            case 12: printf("OpenBSD\n"); break;
-            case 13: printf("OpenVMS\n"); break;
-            default: printf("0x%02X\n", (unsigned int) abi);
+            case 0:  fprintf(outStream, "System V\n"); break;
+            case 1:  fprintf(outStream, "HP-UX\n"); break;
+            case 2:  fprintf(outStream, "NetBSD\n"); break;
+            case 3:  fprintf(outStream, "Linux\n"); break;
+            case 4:  fprintf(outStream, "GNU Hurd\n"); break;
+            case 6:  fprintf(outStream, "Solaris\n"); break;
+            case 7:  fprintf(outStream, "AIX\n"); break;
+            case 8:  fprintf(outStream, "IRIX\n"); break;
+            case 9:  fprintf(outStream, "FreeBSD\n"); break;
+            case 10: fprintf(outStream, "Tru64\n"); break;
+            case 12: fprintf(outStream, "OpenBSD\n"); break;
+            case 13: fprintf(outStream, "OpenVMS\n"); break;
+            default: fprintf(outStream, "0x%02X\n", (unsigned int) abi);
         }
         return;
     }
@@ -1581,10 +2718,10 @@ void ElfFile<ElfFileParamNames>::modifySoname(sonameMode op, const std::string &
 
     auto shdrDynamic = findSectionHeader(".dynamic");
     auto shdrDynStr = findSectionHeader(".dynstr");
-    auto strTab = getStrTab(shdrDynStr);
+    auto strTab = getCurrentStrTab(shdrDynStr);
 
     /* Walk through the dynamic section, look for the DT_SONAME entry. */
-    auto dynSpan = getSectionSpan<Elf_Dyn>(shdrDynamic);
+    auto dynSpan = getCurrentSectionSpan<Elf_Dyn>(shdrDynamic);
     Elf_Dyn * dynSoname = nullptr;
     char * soname = nullptr;
     for (auto * dyn = dynSpan.begin(); dyn < dynSpan.end() && rdi(dyn->d_tag) != DT_NULL; dyn++) {
@@ -1599,7 +2736,7 @@ void ElfFile<ElfFileParamNames>::modifySoname(sonameMode op, const std::string &
             if (strlen(soname) == 0)
                 debug("DT_SONAME is empty\n");
             else
-                printf("%s\n", soname);
+                fprintf(outStream, "%s\n", soname);
         } else {
             debug("no DT_SONAME found\n");
         }
@@ -1613,34 +2750,23 @@ void ElfFile<ElfFileParamNames>::modifySoname(sonameMode op, const std::string &
 
     debug("new SONAME is '%s'\n", newSoname.c_str());
 
-    /* Grow the .dynstr section to make room for the new SONAME. */
-    debug("SONAME is too long, resizing...\n");
-
-    std::string & newDynStr = replaceSection(".dynstr", rdi(shdrDynStr.sh_size) + newSoname.size() + 1);
-    setSubstr(newDynStr, rdi(shdrDynStr.sh_size), newSoname + '\0');
+    const size_t sonameOffset = addString(".dynstr", newSoname);
 
     /* Update the DT_SONAME entry. */
     if (dynSoname) {
-        dynSoname->d_un.d_val = shdrDynStr.sh_size;
+        wri(dynSoname->d_un.d_val, sonameOffset);
+        markDirty(shdrDynamic);
     } else {
         /* There is no DT_SONAME entry in the .dynamic section, so we
            have to grow the .dynamic section. */
-        std::string & newDynamic = replaceSection(".dynamic", rdi(shdrDynamic.sh_size) + sizeof(Elf_Dyn));
-
-        unsigned int idx = dynNullIndex(newDynamic);
-
-        /* Shift all entries down by one. */
-        setSubstr(newDynamic, sizeof(Elf_Dyn), std::string(newDynamic, 0, sizeof(Elf_Dyn) * (idx + 1)));
-
         /* Add the DT_SONAME entry at the top. */
         Elf_Dyn newDyn;
         wri(newDyn.d_tag, DT_SONAME);
-        newDyn.d_un.d_val = shdrDynStr.sh_size;
-        setSubstr(newDynamic, 0, std::string((char *)&newDyn, sizeof(Elf_Dyn)));
+        wri(newDyn.d_un.d_val, sonameOffset);
+        insertDynEntries(&newDyn, 1);
     }
 
     changed = true;
-    this->rewriteSections();
 }
 
 template<ElfFileParams>
@@ -1652,9 +2778,8 @@ void ElfFile<ElfFileParamNames>::setInterpreter(const std::string & newInterpret
     }
 
     std::string & section = replaceSection(".interp", newInterpreter.size() + 1);
-    setSubstr(section, 0, newInterpreter + '\0');
+    memcpy(section.data(), newInterpreter.c_str(), newInterpreter.size() + 1);
     changed = true;
-    this->rewriteSections();
 }
 
 
@@ -1695,8 +2820,8 @@ std::string ElfFile<ElfFileParamNames>::shrinkRPath(char* rpath, std::vector<std
             if (!neededLibFound.at(j)) {
                 std::string libName = dirName + "/" + neededLibs.at(j);
                 try {
-                    Elf32_Half library_e_machine = getElfType(readFile(libName, sizeof(Elf32_Ehdr))).machine;
-                    if (rdi(library_e_machine) == rdi(hdr()->e_machine)) {
+                    int library_e_machine = getElfType(readFile(libName, sizeof(Elf32_Ehdr))).machine;
+                    if (library_e_machine == rdi(hdr()->e_machine)) {
                         neededLibFound.at(j) = true;
                         libFound = true;
                     } else
@@ -1725,7 +2850,7 @@ template<ElfFileParams>
 template<class Drop>
 bool ElfFile<ElfFileParamNames>::compactDynamic(Elf_Shdr & shdrDynamic, Drop && drop)
 {
-    auto dynSpan = getSectionSpan<Elf_Dyn>(shdrDynamic);
+    auto dynSpan = getCurrentSectionSpan<Elf_Dyn>(shdrDynamic);
     Elf_Dyn * out = dynSpan.begin();
     Elf_Dyn * dyn = out;
     for ( ; dyn < dynSpan.end() && rdi(dyn->d_tag) != DT_NULL; dyn++) {
@@ -1736,6 +2861,8 @@ bool ElfFile<ElfFileParamNames>::compactDynamic(Elf_Shdr & shdrDynamic, Drop &&
         out++;
     }
     memset(out, 0, sizeof(Elf_Dyn) * (dyn - out));
+    if (out != dyn)
+        markDirty(shdrDynamic);
     return out != dyn;
 }
 
@@ -1747,7 +2874,6 @@ void ElfFile<ElfFileParamNames>::removeRPath(Elf_Shdr & shdrDynamic) {
         debug("removing %s entry\n", tag == DT_RPATH ? "DT_RPATH" : "DT_RUNPATH");
         return true;
     });
-    this->rewriteSections();
 }
 
 template<ElfFileParams>
@@ -1764,7 +2890,7 @@ void ElfFile<ElfFileParamNames>::modifyRPath(RPathOp op,
     /* !!! We assume that the virtual address in the DT_STRTAB entry
        of the dynamic section corresponds to the .dynstr section. */
     auto shdrDynStr = findSectionHeader(".dynstr");
-    auto strTab = getStrTab(shdrDynStr);
+    auto strTab = getCurrentStrTab(shdrDynStr);
 
 
     /* Walk through the dynamic section, look for the RPATH/RUNPATH
@@ -1780,7 +2906,7 @@ void ElfFile<ElfFileParamNames>::modifyRPath(RPathOp op,
        generates a DT_RPATH and DT_RUNPATH pointing at the same
        string. */
     std::vector<std::string> neededLibs;
-    auto dynSpan = getSectionSpan<Elf_Dyn>(shdrDynamic);
+    auto dynSpan = getCurrentSectionSpan<Elf_Dyn>(shdrDynamic);
     Elf_Dyn *dynRPath = nullptr, *dynRunPath = nullptr;
     char * rpath = nullptr;
     for (auto * dyn = dynSpan.begin(); dyn < dynSpan.end() && rdi(dyn->d_tag) != DT_NULL; dyn++) {
@@ -1800,7 +2926,7 @@ void ElfFile<ElfFileParamNames>::modifyRPath(RPathOp op,
 
     switch (op) {
         case rpPrint: {
-            printf("%s\n", rpath ? rpath : "");
+            fprintf(outStream, "%s\n", rpath ? rpath : "");
             return;
         }
         case rpRemove: {
@@ -1832,11 +2958,13 @@ void ElfFile<ElfFileParamNames>::modifyRPath(RPathOp op,
 
     if (!forceRPath && dynRPath && !dynRunPath) { /* convert DT_RPATH to DT_RUNPATH */
         wri(dynRPath->d_tag, DT_RUNPATH);
+        markDirty(shdrDynamic);
         dynRunPath = dynRPath;
         dynRPath = nullptr;
         changed = true;
     } else if (forceRPath && dynRunPath) { /* convert DT_RUNPATH to DT_RPATH */
         wri(dynRunPath->d_tag, DT_RPATH);
+        markDirty(shdrDynamic);
         dynRPath = dynRunPath;
         dynRunPath = nullptr;
         changed = true;
@@ -1869,7 +2997,10 @@ void ElfFile<ElfFileParamNames>::modifyRPath(RPathOp op,
        Nix. */
     if (rpath && !rpathStrShared) {
         debug("Tainting old rpath with Xs\n");
+        strTabIndices.erase(".dynstr");
         memset(rpath, 'X', rpathSize);
+        if (!hasReplacedSection(".dynstr"))
+            markDirty(rdi(shdrDynStr.sh_offset) + (rpath - strTab.begin()), rpathSize + 1);
     }
 
     debug("new rpath is '%s'\n", newRPath.c_str());
@@ -1880,38 +3011,26 @@ void ElfFile<ElfFileParamNames>::modifyRPath(RPathOp op,
         return;
     }
 
-    /* Grow the .dynstr section to make room for the new RPATH. */
-    debug("rpath is too long or shared, resizing...\n");
+    debug("rpath is too long or shared, adding it to .dynstr\n");
 
-    std::string & newDynStr = replaceSection(".dynstr",
-        rdi(shdrDynStr.sh_size) + newRPath.size() + 1);
-    setSubstr(newDynStr, rdi(shdrDynStr.sh_size), newRPath + '\0');
+    const size_t rpathOffset = addString(".dynstr", newRPath);
 
     /* Update the DT_RUNPATH and DT_RPATH entries. */
     if (dynRunPath || dynRPath) {
-        if (dynRunPath) dynRunPath->d_un.d_val = shdrDynStr.sh_size;
-        if (dynRPath) dynRPath->d_un.d_val = shdrDynStr.sh_size;
+        if (dynRunPath) wri(dynRunPath->d_un.d_val, rpathOffset);
+        if (dynRPath) wri(dynRPath->d_un.d_val, rpathOffset);
+        markDirty(shdrDynamic);
     }
 
     else {
         /* There is no DT_RUNPATH entry in the .dynamic section, so we
            have to grow the .dynamic section. */
-        std::string & newDynamic = replaceSection(".dynamic",
-            rdi(shdrDynamic.sh_size) + sizeof(Elf_Dyn));
-
-        unsigned int idx = dynNullIndex(newDynamic);
-
-        /* Shift all entries down by one. */
-        setSubstr(newDynamic, sizeof(Elf_Dyn),
-            std::string(newDynamic, 0, sizeof(Elf_Dyn) * (idx + 1)));
-
         /* Add the DT_RUNPATH entry at the top. */
         Elf_Dyn newDyn;
         wri(newDyn.d_tag, forceRPath ? DT_RPATH : DT_RUNPATH);
-        newDyn.d_un.d_val = shdrDynStr.sh_size;
-        setSubstr(newDynamic, 0, std::string((char *) &newDyn, sizeof(Elf_Dyn)));
+        wri(newDyn.d_un.d_val, rpathOffset);
+        insertDynEntries(&newDyn, 1);
     }
-    this->rewriteSections();
 }
 
 
@@ -1922,7 +3041,7 @@ void ElfFile<ElfFileParamNames>::removeNeeded(const std::set<std::string> & libs
 
     auto shdrDynamic = findSectionHeader(".dynamic");
     auto shdrDynStr = findSectionHeader(".dynstr");
-    auto strTab = getStrTab(shdrDynStr);
+    auto strTab = getCurrentStrTab(shdrDynStr);
 
     if (compactDynamic(shdrDynamic, [&](const Elf_Dyn & d) {
         if (rdi(d.d_tag) != DT_NEEDED) return false;
@@ -1937,8 +3056,6 @@ void ElfFile<ElfFileParamNames>::removeNeeded(const std::set<std::string> & libs
         changed = true;
         removeResolutionCache();
     }
-
-    this->rewriteSections();
 }
 
 template<ElfFileParams>
@@ -1948,61 +3065,26 @@ void ElfFile<ElfFileParamNames>::replaceNeeded(const std::map<std::string, std::
 
     auto shdrDynamic = findSectionHeader(".dynamic");
     auto shdrDynStr = findSectionHeader(".dynstr");
-    auto strTab = getStrTab(shdrDynStr);
 
-    auto dynSpan = getSectionSpan<Elf_Dyn>(shdrDynamic);
+    auto dynSpan = getCurrentSectionSpan<Elf_Dyn>(shdrDynamic);
 
     bool replaced = false;
     unsigned int verNeedNum = 0;
 
-    unsigned int dynStrAddedBytes = 0;
-    std::unordered_map<std::string, Elf_Off> addedStrings;
-
     for (auto * dyn = dynSpan.begin(); dyn < dynSpan.end() && rdi(dyn->d_tag) != DT_NULL; dyn++) {
         if (rdi(dyn->d_tag) == DT_NEEDED) {
-            char * name = strTabEntry(strTab, rdi(dyn->d_un.d_val));
+            /* Adding a string may move the table, so look the name up afresh. */
+            char * name = strTabEntry(getCurrentStrTab(shdrDynStr), rdi(dyn->d_un.d_val));
             auto i = libs.find(name);
             if (i != libs.end() && name != i->second) {
-                auto orig = i->first;
-                auto replacement = i->second;
-
-                debug("replacing DT_NEEDED entry '%s' with '%s'\n", name, replacement.c_str());
-
-                auto a = addedStrings.find(replacement);
-                // the same replacement string has already been added, reuse it
-                if (a != addedStrings.end()) {
-                    debug("reusing previous replacement\n");
-                    wri(dyn->d_un.d_val, a->second);
-                    continue;
-                }
-
-                // if the replacement a suffix of the original, e.g. when replacing full
-                // paths with the basename or stripping a sysroot-like prefix, then
-                // update the reference to that suffix while keeping the original
-                // intact (thus we can potentially avoid relocating the whole section)
-                auto pos = orig.rfind(replacement);
-                if (pos != std::string::npos && orig.size() == pos + replacement.size()) {
-                    debug("reusing suffix\n");
-                    wri(dyn->d_un.d_val, rdi(dyn->d_un.d_val) + pos);
-                    /* ensure write-out in case all replaces use this technique */
-                    changed = true;
-                    continue;
-                }
+                debug("replacing DT_NEEDED entry '%s' with '%s'\n", name, i->second.c_str());
+                markDirty(shdrDynamic);
 
-                // technically, the string referred by d_val could be used otherwise, too (although unlikely)
-                // we'll therefore add a new string
-                debug("resizing .dynstr ...\n");
-
-                // relative location of the new string
-                Elf_Off strOffset = rdi(shdrDynStr.sh_size) + dynStrAddedBytes;
-                std::string & newDynStr = replaceSection(".dynstr",
-                    strOffset + replacement.size() + 1);
-                setSubstr(newDynStr, strOffset, replacement + '\0');
-
-                wri(dyn->d_un.d_val, strOffset);
-                addedStrings[replacement] = strOffset;
-
-                dynStrAddedBytes += replacement.size() + 1;
+                // the original string is left alone, as it could be used
+                // otherwise, too (although unlikely).  The replacement may
+                // well be in .dynstr already, e.g. as the tail of the
+                // original when replacing full paths with the basename.
+                wri(dyn->d_un.d_val, addString(".dynstr", i->second));
 
                 changed = true;
                 replaced = true;
@@ -2026,51 +3108,28 @@ void ElfFile<ElfFileParamNames>::replaceNeeded(const std::map<std::string, std::
         // arbitrary section and we have to look in ->sh_link to figure out
         // which one.
         Elf_Shdr & shdrVersionRStrings = shdrs.at(rdi(shdrVersionR.sh_link));
-        // this is where we find the actual filename strings
-        auto verStrTab = getStrTab(shdrVersionRStrings);
         // and we also need the name of the section containing the strings, so
         // that we can pass it to replaceSection
-        std::string versionRStringsSName = getSectionName(shdrVersionRStrings);
+        std::string versionRStringsSName(getSectionName(shdrVersionRStrings));
 
         debug("found .gnu.version_r with %i entries, strings in %s\n", verNeedNum, versionRStringsSName.c_str());
 
-        unsigned int verStrAddedBytes = 0;
-        // It may be that it is .dynstr again, in which case we must take the already
-        // added bytes into account.
-        if (versionRStringsSName == ".dynstr")
-            verStrAddedBytes += dynStrAddedBytes;
-        else
-            // otherwise the already added strings can't be reused
-            addedStrings.clear();
+        // Usually it is .dynstr again, in which case the strings added
+        // above are reused.
 
-        auto needBytes = getSectionSpan<char>(shdrVersionR);
+        auto needBytes = getCurrentSectionSpan<char>(shdrVersionR);
         for (auto need = verHead<Elf_Verneed>(needBytes);
              need && verNeedNum > 0;
              need = follow<Elf_Verneed>(needBytes, need, rdi(need->vn_next)), --verNeedNum) {
-            char * file = strTabEntry(verStrTab, rdi(need->vn_file));
+            char * file = strTabEntry(getCurrentStrTab(shdrVersionRStrings), rdi(need->vn_file));
             auto i = libs.find(file);
             if (i != libs.end() && file != i->second) {
                 auto replacement = i->second;
 
                 debug("replacing .gnu.version_r entry '%s' with '%s'\n", file, replacement.c_str());
+                markDirty(shdrVersionR);
 
-                auto a = addedStrings.find(replacement);
-                // the same replacement string has already been added, reuse it
-                if (a != addedStrings.end()) {
-                    wri(need->vn_file, a->second);
-                } else {
-                    debug("resizing string section %s ...\n", versionRStringsSName.c_str());
-
-                    Elf_Off strOffset = rdi(shdrVersionRStrings.sh_size) + verStrAddedBytes;
-                    std::string & newVerDynStr = replaceSection(versionRStringsSName,
-                        strOffset + replacement.size() + 1);
-                    setSubstr(newVerDynStr, strOffset, replacement + '\0');
-
-                    wri(need->vn_file, strOffset);
-                    addedStrings[replacement] = strOffset;
-
-                    verStrAddedBytes += replacement.size() + 1;
-                }
+                wri(need->vn_file, addString(versionRStringsSName, replacement));
 
                 changed = true;
                 replaced = true;
@@ -2081,8 +3140,6 @@ void ElfFile<ElfFileParamNames>::replaceNeeded(const std::map<std::string, std::
     }
 
     if (replaced) removeResolutionCache();
-
-    this->rewriteSections();
 }
 
 template<ElfFileParams>
@@ -2090,66 +3147,36 @@ void ElfFile<ElfFileParamNames>::addNeeded(const std::set<std::string> & libs)
 {
     if (libs.empty()) return;
 
-    auto shdrDynamic = findSectionHeader(".dynamic");
-    auto shdrDynStr = findSectionHeader(".dynstr");
-
-    unsigned int length = 0;
-
     /* add all new libs to the dynstr string table */
-    for (auto &lib : libs)
-        length += lib.size() + 1;
-
-    std::string & newDynStr = replaceSection(".dynstr",
-        rdi(shdrDynStr.sh_size) + length + 1);
-
-    std::set<Elf64_Xword> libStrings;
-    unsigned int pos = 0;
-    for (auto & i : libs) {
-        setSubstr(newDynStr, rdi(shdrDynStr.sh_size) + pos, i + '\0');
-        libStrings.insert(rdi(shdrDynStr.sh_size) + pos);
-        pos += i.size() + 1;
+    std::vector<Elf_Dyn> newDyns(libs.size());
+    auto newDyn = newDyns.begin();
+    for (auto & lib : libs) {
+        wri(newDyn->d_tag, DT_NEEDED);
+        wri(newDyn->d_un.d_val, addString(".dynstr", lib));
+        ++newDyn;
     }
 
-    /* add all new needed entries to the dynamic section */
-    std::string & newDynamic = replaceSection(".dynamic",
-        rdi(shdrDynamic.sh_size) + sizeof(Elf_Dyn) * libs.size());
-
-    unsigned int idx = dynNullIndex(newDynamic);
-
-    /* Shift all entries down by the number of new entries. */
-    setSubstr(newDynamic, sizeof(Elf_Dyn) * libs.size(),
-        std::string(newDynamic, 0, sizeof(Elf_Dyn) * (idx + 1)));
-
-    /* Add the DT_NEEDED entries at the top. */
-    unsigned int i = 0;
-    for (auto & j : libStrings) {
-        Elf_Dyn newDyn;
-        wri(newDyn.d_tag, DT_NEEDED);
-        wri(newDyn.d_un.d_val, j);
-        setSubstr(newDynamic, i * sizeof(Elf_Dyn), std::string((char *) &newDyn, sizeof(Elf_Dyn)));
-        i++;
-    }
+    /* add all new needed entries at the top of the dynamic section */
+    insertDynEntries(newDyns.data(), newDyns.size());
 
     removeResolutionCache();
 
     changed = true;
-
-    this->rewriteSections();
 }
 
 template<ElfFileParams>
-void ElfFile<ElfFileParamNames>::printNeededLibs() const
+void ElfFile<ElfFileParamNames>::printNeededLibs()
 {
     const auto shdrDynamic = findSectionHeader(".dynamic");
     const auto shdrDynStr = findSectionHeader(".dynstr");
-    auto strTab = getStrTab(shdrDynStr);
+    auto strTab = getCurrentStrTab(shdrDynStr);
 
-    auto dynSpan = getSectionSpan<Elf_Dyn>(shdrDynamic);
+    auto dynSpan = getCurrentSectionSpan<Elf_Dyn>(shdrDynamic);
 
     for (const auto * dyn = dynSpan.begin(); dyn < dynSpan.end() && rdi(dyn->d_tag) != DT_NULL; dyn++) {
         if (rdi(dyn->d_tag) == DT_NEEDED) {
             const char *name = strTabEntry(strTab, rdi(dyn->d_un.d_val));
-            printf("%s\n", name);
+            fprintf(outStream, "%s\n", name);
         }
     }
 }
@@ -2160,7 +3187,7 @@ void ElfFile<ElfFileParamNames>::noDefaultLib()
 {
     auto shdrDynamic = findSectionHeader(".dynamic");
 
-    auto dynSpan = getSectionSpan<Elf_Dyn>(shdrDynamic);
+    auto dynSpan = getCurrentSectionSpan<Elf_Dyn>(shdrDynamic);
     auto dynFlags1 = (Elf_Dyn *)nullptr;
     for (auto * dyn = dynSpan.begin(); dyn < dynSpan.end() && rdi(dyn->d_tag) != DT_NULL; dyn++) {
         if (rdi(dyn->d_tag) == DT_FLAGS_1) {
@@ -2172,24 +3199,15 @@ void ElfFile<ElfFileParamNames>::noDefaultLib()
         if (dynFlags1->d_un.d_val & DF_1_NODEFLIB)
             return;
         dynFlags1->d_un.d_val |= DF_1_NODEFLIB;
+        markDirty(shdrDynamic);
     } else {
-        std::string & newDynamic = replaceSection(".dynamic",
-                rdi(shdrDynamic.sh_size) + sizeof(Elf_Dyn));
-
-        unsigned int idx = dynNullIndex(newDynamic);
-
-        /* Shift all entries down by one. */
-        setSubstr(newDynamic, sizeof(Elf_Dyn),
-                std::string(newDynamic, 0, sizeof(Elf_Dyn) * (idx + 1)));
-
         /* Add the DT_FLAGS_1 entry at the top. */
         Elf_Dyn newDyn;
         wri(newDyn.d_tag, DT_FLAGS_1);
         newDyn.d_un.d_val = DF_1_NODEFLIB;
-        setSubstr(newDynamic, 0, std::string((char *) &newDyn, sizeof(Elf_Dyn)));
+        insertDynEntries(&newDyn, 1);
     }
 
-    this->rewriteSections();
     changed = true;
 }
 
@@ -2198,28 +3216,18 @@ void ElfFile<ElfFileParamNames>::addDebugTag()
 {
     auto shdrDynamic = findSectionHeader(".dynamic");
 
-    auto dynSpan = getSectionSpan<Elf_Dyn>(shdrDynamic);
+    auto dynSpan = getCurrentSectionSpan<Elf_Dyn>(shdrDynamic);
     for (auto * dyn = dynSpan.begin(); dyn < dynSpan.end() && rdi(dyn->d_tag) != DT_NULL; dyn++) {
         if (rdi(dyn->d_tag) == DT_DEBUG) {
             return;
         }
     }
-    std::string & newDynamic = replaceSection(".dynamic",
-            rdi(shdrDynamic.sh_size) + sizeof(Elf_Dyn));
-
-    unsigned int idx = dynNullIndex(newDynamic);
-
-    /* Shift all entries down by one. */
-    setSubstr(newDynamic, sizeof(Elf_Dyn),
-            std::string(newDynamic, 0, sizeof(Elf_Dyn) * (idx + 1)));
-
     /* Add the DT_DEBUG entry at the top. */
     Elf_Dyn newDyn;
     wri(newDyn.d_tag, DT_DEBUG);
     newDyn.d_un.d_val = 0;
-    setSubstr(newDynamic, 0, std::string((char *) &newDyn, sizeof(Elf_Dyn)));
+    insertDynEntries(&newDyn, 1);
 
-    this->rewriteSections();
     changed = true;
 }
 
@@ -2249,8 +3257,10 @@ void ElfFile<ElfFileParamNames>::removeResolutionCache()
        zero them on disk; otherwise Nix's reference scanner would keep picking
        up store paths that may already be stale after an rpath change (cf. the
        'X' tainting of removed rpaths in modifyRPath). */
-    if (noteOffset <= fileContents->size() && noteSize <= fileContents->size() - noteOffset)
+    if (noteOffset <= fileContents->size() && noteSize <= fileContents->size() - noteOffset) {
         memset(fileContents->data() + noteOffset, 0, noteSize);
+        markDirty(noteOffset, noteSize);
+    }
 
     phdrs.erase(std::remove_if(phdrs.begin(), phdrs.end(), [&] (const Elf_Phdr & phdr) {
         const auto type = rdi(phdr.p_type);
@@ -2262,6 +3272,13 @@ void ElfFile<ElfFileParamNames>::removeResolutionCache()
 
     shdrs.erase(shdrs.begin() + noteIndex);
     wri(hdr()->e_shnum, shdrs.size());
+    indexSections();
+
+    for (auto & i : sectionsByOldIndex)
+        if (i == noteIndex)
+            i = 0;
+        else if (i > noteIndex)
+            i--;
 
     const unsigned int shstrndx = rdi(hdr()->e_shstrndx);
     if (shstrndx == noteIndex)
@@ -2316,12 +3333,12 @@ void ElfFile<ElfFileParamNames>::buildResolutionCache()
     auto shdrDynStr = tryFindSectionHeader(".dynstr");
     if (!shdrDynamic || !shdrDynStr) {
         failIfStale();
-        fprintf(stderr, "warning: --build-resolution-cache: no dynamic section (statically linked?); no cache written\n");
+        fprintf(errStream, "warning: --build-resolution-cache: no dynamic section (statically linked?); no cache written\n");
         return;
     }
 
-    auto strTab = getStrTab(shdrDynStr->get());
-    auto dynSpan = getSectionSpan<Elf_Dyn>(shdrDynamic->get());
+    auto strTab = getCurrentStrTab(shdrDynStr->get());
+    auto dynSpan = getCurrentSectionSpan<Elf_Dyn>(shdrDynamic->get());
 
     std::vector<std::string> needed;
     const char * dtRunPath = nullptr;
@@ -2340,7 +3357,7 @@ void ElfFile<ElfFileParamNames>::buildResolutionCache()
         runPathStr ? splitColonDelimitedString(runPathStr) : std::vector<std::string>{};
     if (needed.empty() || runPath.empty()) {
         failIfStale();
-        fprintf(stderr, "warning: --build-resolution-cache: no DT_NEEDED entries or run path to resolve; no cache written\n");
+        fprintf(errStream, "warning: --build-resolution-cache: no DT_NEEDED entries or run path to resolve; no cache written\n");
         return;
     }
 
@@ -2388,7 +3405,7 @@ void ElfFile<ElfFileParamNames>::buildResolutionCache()
     }
     if (cache.empty()) {
         failIfStale();
-        fprintf(stderr, "warning: --build-resolution-cache: no libraries resolved against the run path; no cache written\n");
+        fprintf(errStream, "warning: --build-resolution-cache: no libraries resolved against the run path; no cache written\n");
         return;
     }
 
@@ -2433,6 +3450,10 @@ void ElfFile<ElfFileParamNames>::buildResolutionCache()
         failIfStale();
     }
 
+    /* The note goes at the end of the file as it will be laid out, so
+       lay out the edits made so far first. */
+    rewriteSections();
+
     const size_t descSize = desc.size();
     const size_t nameSize = roundUp(sizeof(ldCacheNoteName), 4);
     const size_t noteSize = sizeof(Elf_Nhdr) + nameSize + roundUp(descSize, 4);
@@ -2464,7 +3485,7 @@ void ElfFile<ElfFileParamNames>::buildResolutionCache()
            is smaller still. Pad the address so that p_vaddr >= p_offset. */
         noteAddr += roundUp(minDiff, pageSize);
 
-    fileContents->resize(noteOffset + noteSize, 0);
+    growFile(noteOffset + noteSize);
     auto * note = fileContents->data() + noteOffset;
     auto & nhdr = *(Elf_Nhdr *) note;
     wri(nhdr.n_namesz, sizeof(ldCacheNoteName));
@@ -2500,22 +3521,39 @@ void ElfFile<ElfFileParamNames>::buildResolutionCache()
 
     /* Resolve the section-header string table via e_shstrndx, not a literal
        ".shstrtab": some strip tools rename or merge it. */
-    const std::string shstrtabName = getSectionName(shdrs.at(rdi(hdr()->e_shstrndx)));
+    const std::string shstrtabName(getSectionName(shdrs.at(rdi(hdr()->e_shstrndx))));
     sectionNames += ldCacheSectionName;
     sectionNames += '\0';
+    indexSections();
     replaceSection(shstrtabName, sectionNames.size()) = sectionNames;
 
-    rewriteSections();
     changed = true;
 }
 
+/* Four characters at a time, h * 33^4 + c0 * 33^3 + c1 * 33^2 + c2 * 33 + c3
+   is the same as four single steps, but with independent multiplications
+   rather than one long chain of them. */
 static uint32_t gnuHash(std::string_view name) {
     uint32_t h = 5381;
-    for (uint8_t c : name)
-        h = ((h << 5) + h) + c;
+    auto * p = reinterpret_cast<const uint8_t *>(name.data());
+    auto * end = p + name.size();
+    for (; end - p >= 4; p += 4)
+        h = h * (33 * 33 * 33 * 33) + p[0] * (33 * 33 * 33) + p[1] * (33 * 33) + p[2] * 33 + p[3];
+    for (; p < end; ++p)
+        h = ((h << 5) + h) + *p;
     return h;
 }
 
+template<ElfFileParams>
+template<class Hash, class Store>
+void ElfFile<ElfFileParamNames>::hashSymbolNames(span<char> strTab, span<Elf_Sym> syms, Hash && hash, Store && store)
+{
+    forSymbolParts(syms.size(), [&](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+            store(i, hash(&strTab[rdi(syms[i].st_name)]));
+    });
+}
+
 template<ElfFileParams>
 auto ElfFile<ElfFileParamNames>::parseGnuHashTable(span<char> sectionData) -> GnuHashTable
 {
@@ -2535,19 +3573,45 @@ auto ElfFile<ElfFileParamNames>::parseGnuHashTable(span<char> sectionData) -> Gn
     return GnuHashTable{*hdr, bloomFilters, buckets, table};
 }
 
+/* The symbols in 'syms' that the profile has lookups for, the busiest
+   first, and otherwise in their current order. */
+template<ElfFileParams>
+std::vector<uint32_t> ElfFile<ElfFileParamNames>::hotSymbols(span<char> strTab, span<Elf_Sym> syms) const
+{
+    std::vector<std::pair<uint64_t, uint32_t>> hot;
+    if (symbolProfile && !symbolProfile->empty())
+        for (uint32_t i = 0; i < syms.size(); ++i) {
+            auto it = symbolProfile->find(strTabEntry(strTab, rdi(syms[i].st_name)));
+            if (it != symbolProfile->end() && it->second)
+                hot.emplace_back(it->second, i);
+        }
+    std::stable_sort(hot.begin(), hot.end(), [] (auto & a, auto & b) { return a.first > b.first; });
+
+    std::vector<uint32_t> res;
+    res.reserve(hot.size());
+    for (auto & [count, i] : hot)
+        res.push_back(i);
+    return res;
+}
+
 template<ElfFileParams>
 void ElfFile<ElfFileParamNames>::rebuildGnuHashTable(span<char> strTab, span<Elf_Sym> dynsyms)
 {
-    auto sectionData = tryGetSectionSpan<char>(".gnu.hash");
-    if (!sectionData)
+    auto shdrGnuHash = tryFindSectionHeader(".gnu.hash");
+    if (!shdrGnuHash)
         return;
 
-    auto ght = parseGnuHashTable(sectionData);
+    auto ght = parseGnuHashTable(getCurrentSectionSpan<char>(*shdrGnuHash));
 
     // We can't trust the value of symndx when the hash table is empty
     if (ght.m_table.size() == 0)
         return;
 
+    markDirty(findSectionHeader(".gnu.hash"));
+    markDirty(findSectionHeader(".dynsym"));
+    if (auto shdrVersym = tryFindSectionHeader(".gnu.version"))
+        markDirty(*shdrVersym);
+
     // The hash table includes only a subset of dynsyms
     auto firstSymIdx = rdi(ght.m_hdr.symndx);
     dynsyms = span(&dynsyms[firstSymIdx], dynsyms.end());
@@ -2557,68 +3621,95 @@ void ElfFile<ElfFileParamNames>::rebuildGnuHashTable(span<char> strTab, span<Elf
     if (versyms)
         versyms = span(&versyms[firstSymIdx], versyms.end());
 
-    struct Entry
-    {
-        uint32_t hash, bucketIdx, originalPos;
-    };
-
-    std::vector<Entry> entries;
-    entries.reserve(dynsyms.size());
-
-    uint32_t pos = 0; // Track the original position of the symbol in the table
-    for (auto& sym : dynsyms)
+    // The hashes go straight into the chain table, which is permuted along
+    // with the symbols and gets its end-of-chain bits at the end
+    size_t numSyms = dynsyms.size();
+    if (ght.m_table.size() < numSyms)
+        error(".gnu.hash table has fewer entries than the symbol table");
+    if (numSyms >= (size_t(1) << 31))
+        error(".gnu.hash table has too many entries");
+    hashSymbolNames(strTab, dynsyms, gnuHash, [&] (size_t i, uint32_t hash) {
+        wri(ght.m_table[i], hash);
+    });
+    auto numBuckets = ght.m_buckets.size();
+    std::vector<uint32_t> bucketStart(numBuckets + 1);
+    for (size_t i = 0; i < numSyms; ++i)
+        bucketStart[rdi(ght.m_table[i]) % numBuckets + 1]++;
+
+    // Sort the entries based on the buckets. This is a requirement for gnu
+    // hash table to work. A counting sort gives each symbol its new position
+    // directly, and keeps the original order within a bucket, except that
+    // the symbols in the profile come first, the busiest at the front
+    std::partial_sum(bucketStart.begin(), bucketStart.end(), bucketStart.begin());
+    std::vector<uint32_t> old2new(numSyms);
     {
-        Entry e;
-        e.hash = gnuHash(&strTab[rdi(sym.st_name)]);
-        e.bucketIdx = e.hash % ght.m_buckets.size();
-        e.originalPos = pos++;
-        entries.push_back(e);
+        std::vector<uint32_t> nextPos(bucketStart.begin(), bucketStart.end() - 1);
+        std::vector<bool> placed(numSyms);
+        for (auto i : hotSymbols(strTab, dynsyms)) {
+            old2new[i] = nextPos[rdi(ght.m_table[i]) % numBuckets]++;
+            placed[i] = true;
+        }
+        for (size_t i = 0; i < numSyms; ++i)
+            if (!placed[i])
+                old2new[i] = nextPos[rdi(ght.m_table[i]) % numBuckets]++;
     }
 
-    // Sort the entries based on the buckets. This is a requirement for gnu hash table to work
-    std::sort(entries.begin(), entries.end(), [&] (auto& l, auto& r) {
-        return l.bucketIdx < r.bucketIdx;
-    });
-
-    // Create a map of old positions to new positions after sorting
-    std::vector<uint32_t> old2new(entries.size());
-    for (size_t i = 0; i < entries.size(); ++i)
-        old2new[entries[i].originalPos] = i;
-
-    // Update the symbol table with the new order and
-    // all tables that refer to symbols through indexes in the symbol table
-    auto reorderSpan = [] (auto dst, auto& old2new)
+    // Update the symbol table with the new order, moving every symbol, its
+    // version and its hash in place one cycle of the permutation at a time.
+    // The top bit of old2new marks the positions that are done
+    constexpr uint32_t done = uint32_t(1) << 31;
+    for (size_t start = 0; start < numSyms; ++start)
     {
-        std::vector<std::remove_reference_t<decltype(dst[0])>> tmp(dst.begin(), dst.end());
-        for (size_t i = 0; i < tmp.size(); ++i)
-            dst[old2new[i]] = tmp[i];
-    };
-
-    reorderSpan(dynsyms, old2new);
-    if (versyms)
-        reorderSpan(versyms, old2new);
+        if (old2new[start] & done)
+            continue;
+        Elf_Sym sym = dynsyms[start];
+        Elf_Versym versym = versyms ? versyms[start] : 0;
+        uint32_t hash = ght.m_table[start];
+        for (size_t cur = start; !(old2new[cur] & done); )
+        {
+            size_t next = old2new[cur];
+            old2new[cur] |= done;
+            std::swap(sym, dynsyms[next]);
+            if (versyms)
+                std::swap(versym, versyms[next]);
+            std::swap(hash, ght.m_table[next]);
+            cur = next;
+        }
+    }
+    for (auto & pos : old2new)
+        pos &= ~done;
 
+    // Update all tables that refer to symbols through indexes in the symbol
+    // table. Relocations against .symtab (from --emit-relocs) are left
+    // alone, as are indexes past the end of .dynsym
     auto remapSymbolId = [&old2new, firstSymIdx] (auto& oldSymIdx)
     {
-        return oldSymIdx >= firstSymIdx ? old2new[oldSymIdx - firstSymIdx] + firstSymIdx
-                                        : oldSymIdx;
+        return oldSymIdx >= firstSymIdx && oldSymIdx - firstSymIdx < old2new.size()
+            ? old2new[oldSymIdx - firstSymIdx] + firstSymIdx
+            : oldSymIdx;
     };
 
+    auto dynsymIndex = getSectionIndex(".dynsym");
     for (unsigned int i = 1; i < rdi(hdr()->e_shnum); ++i)
     {
         auto& shdr = shdrs.at(i);
+        if (rdi(shdr.sh_link) != dynsymIndex)
+            continue;
         auto shtype = rdi(shdr.sh_type);
         if (shtype == SHT_REL)
             changeRelocTableSymIds<Elf_Rel>(shdr, remapSymbolId);
         else if (shtype == SHT_RELA)
             changeRelocTableSymIds<Elf_Rela>(shdr, remapSymbolId);
+        else
+            continue;
+        markDirty(shdr);
     }
 
     // Update bloom filters
     std::fill(ght.m_bloomFilters.begin(), ght.m_bloomFilters.end(), 0);
-    for (size_t i = 0; i < entries.size(); ++i)
+    for (size_t i = 0; i < numSyms; ++i)
     {
-        auto h = entries[i].hash;
+        auto h = rdi(ght.m_table[i]);
         size_t idx = (h / ElfClass) % ght.m_bloomFilters.size();
         auto val = rdi(ght.m_bloomFilters[idx]);
         val |= uint64_t(1) << (h % ElfClass);
@@ -2626,23 +3717,220 @@ void ElfFile<ElfFileParamNames>::rebuildGnuHashTable(span<char> strTab, span<Elf
         wri(ght.m_bloomFilters[idx], val);
     }
 
-    // Fill buckets
-    std::fill(ght.m_buckets.begin(), ght.m_buckets.end(), 0);
-    for (size_t i = 0; i < entries.size(); ++i)
+    // Fill buckets and mark the end of each chain in the hash table
+    for (size_t b = 0; b < numBuckets; ++b)
     {
-        auto symBucketIdx = entries[i].bucketIdx;
-        if (!ght.m_buckets[symBucketIdx])
-            wri(ght.m_buckets[symBucketIdx], i + firstSymIdx);
+        auto first = bucketStart[b], end = bucketStart[b + 1];
+        wri(ght.m_buckets[b], first == end ? 0 : first + firstSymIdx);
+        for (auto i = first; i < end; ++i)
+        {
+            auto h = rdi(ght.m_table[i]);
+            // Add hash with first bit indicating end of chain
+            wri(ght.m_table[i], i + 1 == end ? (h | 1) : (h & ~1));
+        }
     }
+}
 
-    // Fill hash table
-    for (size_t i = 0; i < entries.size(); ++i)
-    {
-        auto& n = entries[i];
-        bool isLast = (i == entries.size() - 1) || (n.bucketIdx != entries[i+1].bucketIdx);
-        // Add hash with first bit indicating end of chain
-        wri(ght.m_table[i], isLast ? (n.hash | 1) : (n.hash & ~1));
+/* Parameters for a .gnu.hash table of the symbols with the given hashes:
+   enough buckets that a successful lookup takes at most 1.6 hash
+   comparisons on average (which is about one symbol per bucket), and a
+   Bloom filter that lets through
+   at most one in 64 lookups of a symbol that is not there. */
+template<unsigned int ElfClass>
+static void tuneGnuHash(const std::vector<uint32_t> & hashes,
+    uint32_t & numBuckets, uint32_t & maskwords, uint32_t & shift2)
+{
+    const size_t n = std::max<size_t>(hashes.size(), 1);
+
+    auto isPrime = [](size_t x) {
+        for (size_t d = 2; d * d <= x; ++d)
+            if (x % d == 0) return false;
+        return x >= 2;
+    };
+
+    /* The fewest buckets that get there with these hashes, if any; the
+       most of them tried otherwise. */
+    std::vector<uint32_t> chainLength;
+    for (size_t want : {n / 2, n * 2 / 3, n, n * 3 / 2, n * 2}) {
+        size_t b = std::max<size_t>(want, 1);
+        while (b > 2 && !isPrime(b)) ++b;
+        chainLength.assign(b, 0);
+        size_t comparisons = 0;
+        for (auto h : hashes)
+            comparisons += ++chainLength[h % b];
+        numBuckets = b;
+        if (comparisons * 5 <= n * 8)
+            break;
+    }
+
+    /* The smallest filter that gets there, with the second bit taken from
+       whichever part of the hash sets the fewest bits. A symbol that is
+       not there passes if both bits it picks in its word are set. */
+    constexpr unsigned int log2Class = ElfClass == 64 ? 6 : 5;
+    std::vector<uint64_t> words;
+    for (size_t m = 1; ; m *= 2) {
+        if (m * ElfClass < n * 8 && m * ElfClass < (size_t(1) << 31))
+            continue;
+        unsigned int log2Bits = log2Class;
+        while ((size_t(1) << log2Bits) < m * ElfClass) ++log2Bits;
+        double bestRate = 2;
+        for (unsigned int s = std::max(log2Bits, 2u) - 2; s <= std::min(log2Bits + 4, 31u); ++s) {
+            words.assign(m, 0);
+            for (auto h : hashes)
+                words[(h / ElfClass) % m] |= (uint64_t(1) << (h % ElfClass)) | (uint64_t(1) << ((h >> s) % ElfClass));
+            double rate = 0;
+            for (auto w : words)
+                rate += double(__builtin_popcountll(w)) * __builtin_popcountll(w);
+            rate /= double(m) * ElfClass * ElfClass;
+            if (rate < bestRate) {
+                bestRate = rate;
+                shift2 = s;
+            }
+        }
+        maskwords = m;
+        if (bestRate <= 1.0 / 64 || m * ElfClass >= n * 64)
+            break;
+    }
+}
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::optimizeGnuHash()
+{
+    auto shdrGnuHash = tryFindSectionHeader(".gnu.hash");
+    if (!shdrGnuHash) {
+        addGnuHashTable();
+        return;
+    }
+
+    auto ght = parseGnuHashTable(getCurrentSectionSpan<char>(*shdrGnuHash));
+    // We can't trust the value of symndx when the hash table is empty
+    if (ght.m_table.size() == 0) {
+        debug(".gnu.hash is empty, nothing to optimize\n");
+        return;
+    }
+    debug(".gnu.hash had %d buckets, %d mask words, shift %d\n",
+        rdi(ght.m_hdr.numBuckets), rdi(ght.m_hdr.maskwords), rdi(ght.m_hdr.shift2));
+
+    layOutGnuHashTable(rdi(ght.m_hdr.symndx));
+}
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::addGnuHashTable()
+{
+    auto shdrHash = tryFindSectionHeader(".hash");
+    auto shdrDynamic = tryFindSectionHeader(".dynamic");
+    if (!shdrHash || !shdrDynamic) {
+        debug("no .hash section, no .gnu.hash to add\n");
+        return;
+    }
+
+    /* Executables only have room for sections that are moved to the
+       front of the file, which the section name table is not. */
+    if (rdi(hdr()->e_type) != ET_DYN) {
+        fprintf(errStream, "warning: cannot add a .gnu.hash section to an executable that is not position-independent\n");
+        return;
+    }
+
+    /* Local symbols are never looked up, and neither are undefined ones,
+       which come first as far as they can. */
+    const auto & shdrDynsym = findSectionHeader(".dynsym");
+    auto dynsyms = getCurrentSectionSpan<Elf_Sym>(shdrDynsym);
+    size_t symndx = std::min<size_t>(rdi(shdrDynsym.sh_info), dynsyms.size());
+    while (symndx < dynsyms.size() && rdi(dynsyms[symndx].st_shndx) == SHN_UNDEF)
+        symndx++;
+    if (symndx == dynsyms.size()) {
+        debug("no symbols to look up, no .gnu.hash to add\n");
+        return;
+    }
+
+    debug("adding a .gnu.hash section\n");
+
+    /* The new section starts out empty, where .hash is, so that it is
+       sorted next to it, and is laid out like any replaced section. */
+    Elf_Shdr shdr{};
+    wri(shdr.sh_name, sectionNames.size());
+    wri(shdr.sh_type, SHT_GNU_HASH);
+    wri(shdr.sh_flags, SHF_ALLOC);
+    wri(shdr.sh_addr, rdi(shdrHash->get().sh_addr));
+    wri(shdr.sh_offset, rdi(shdrHash->get().sh_offset));
+    wri(shdr.sh_link, getSectionIndex(".dynsym"));
+    wri(shdr.sh_addralign, sizeof(Elf_Addr));
+    shdrs.push_back(shdr);
+    wri(hdr()->e_shnum, shdrs.size());
+
+    const std::string shstrtabName(getSectionName(shdrs.at(rdi(hdr()->e_shstrndx))));
+    sectionNames += ".gnu.hash";
+    sectionNames += '\0';
+    indexSections();
+    replaceSection(shstrtabName, sectionNames.size()) = sectionNames;
+
+    /* rewriteHeaders() fills in the address. Stripping .gnu.hash may have
+       left the entry behind. */
+    bool hasEntry = false;
+    for (auto & dyn : getCurrentSectionSpan<Elf_Dyn>(findSectionHeader(".dynamic")))
+        hasEntry = hasEntry || rdi(dyn.d_tag) == DT_GNU_HASH;
+    if (!hasEntry) {
+        Elf_Dyn newDyn;
+        wri(newDyn.d_tag, DT_GNU_HASH);
+        newDyn.d_un.d_ptr = 0;
+        insertDynEntries(&newDyn, 1);
+    }
+
+    layOutGnuHashTable(symndx);
+}
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::layOutGnuHashTable(uint32_t symndx)
+{
+    const auto & shdrGnuHash = findSectionHeader(".gnu.hash");
+    auto dynsyms = getCurrentSectionSpan<Elf_Sym>(findSectionHeader(".dynsym"));
+    auto strTab = getCurrentStrTab(findSectionHeader(".dynstr"));
+    if (symndx > dynsyms.size())
+        error(".gnu.hash symbol index out of range");
+    auto hashed = span(dynsyms.begin() + symndx, dynsyms.end());
+    if (hashed.size() == 0) {
+        debug(".gnu.hash holds no symbols, nothing to optimize\n");
+        return;
+    }
+
+    std::vector<uint32_t> hashes(hashed.size());
+    hashSymbolNames(strTab, hashed, gnuHash, [&] (size_t i, uint32_t hash) {
+        hashes[i] = hash;
+    });
+
+    typename GnuHashTable::Header newHdr;
+    newHdr.symndx = symndx;
+    tuneGnuHash<ElfClass>(hashes, newHdr.numBuckets, newHdr.maskwords, newHdr.shift2);
+    debug(".gnu.hash: %d buckets, %d mask words, shift %d\n",
+        newHdr.numBuckets, newHdr.maskwords, newHdr.shift2);
+
+    size_t newSize = sizeof(newHdr) + newHdr.maskwords * sizeof(typename GnuHashTable::BloomWord)
+        + (newHdr.numBuckets + hashed.size()) * sizeof(uint32_t);
+    size_t oldSize = getCurrentSectionSize(shdrGnuHash);
+
+    /* A larger table has to move; a smaller one stays where it is, with
+       the tail it no longer needs zeroed. */
+    span<char> data;
+    if (newSize > oldSize || hasReplacedSection(".gnu.hash")) {
+        auto & contents = replaceSection(".gnu.hash", newSize);
+        data = span(contents.data(), contents.size());
+    } else {
+        data = getSectionSpan<char>(shdrGnuHash);
+        markDirty(shdrGnuHash);
+        setSectionSize(getSectionIndex(".gnu.hash"), newSize);
     }
+    std::fill(data.begin(), data.end(), 0);
+
+    auto hdr = reinterpret_cast<typename GnuHashTable::Header *>(data.begin());
+    wri(hdr->numBuckets, newHdr.numBuckets);
+    wri(hdr->symndx, newHdr.symndx);
+    wri(hdr->maskwords, newHdr.maskwords);
+    wri(hdr->shift2, newHdr.shift2);
+
+    /* This reorders the symbols, so .hash has to follow. */
+    rebuildGnuHashTable(strTab, dynsyms);
+    rebuildHashTable(strTab, dynsyms);
+    changed = true;
 }
 
 static uint32_t sysvHash(std::string_view name) {
@@ -2683,6 +3971,7 @@ void ElfFile<ElfFileParamNames>::rebuildHashTable(span<char> strTab, span<Elf_Sy
         return;
 
     auto ht = parseHashTable(sectionData);
+    markDirty(findSectionHeader(".hash"));
 
     std::fill(ht.m_buckets.begin(), ht.m_buckets.end(), 0);
     std::fill(ht.m_chain.begin(), ht.m_chain.end(), 0);
@@ -2691,53 +3980,245 @@ void ElfFile<ElfFileParamNames>::rebuildHashTable(span<char> strTab, span<Elf_Sy
     auto firstSymIdx = dynsyms.size() - ht.m_chain.size();
     dynsyms = span(&dynsyms[firstSymIdx], dynsyms.end());
 
-    for (auto& sym : dynsyms)
-    {
-        auto name = &strTab[rdi(sym.st_name)];
-        uint32_t i = &sym - dynsyms.begin();
-        uint32_t hash = sysvHash(name) % ht.m_buckets.size();
+    // The chain table holds the hashes until it is filled in
+    hashSymbolNames(strTab, dynsyms, sysvHash, [&] (size_t i, uint32_t hash) {
+        wri(ht.m_chain[i], hash);
+    });
+    auto insert = [&] (uint32_t i) {
+        uint32_t hash = rdi(ht.m_chain[i]) % ht.m_buckets.size();
         wri(ht.m_chain[i], rdi(ht.m_buckets[hash]));
         wri(ht.m_buckets[hash], i);
+    };
+
+    // Each symbol goes in front of its chain, so the ones in the profile
+    // are added last, the busiest of them at the very end
+    auto hot = hotSymbols(strTab, dynsyms);
+    std::vector<bool> isHot(dynsyms.size());
+    for (auto i : hot)
+        isHot[i] = true;
+    for (uint32_t i = 0; i < dynsyms.size(); ++i)
+        if (!isHot[i])
+            insert(i);
+    for (auto i = hot.rbegin(); i != hot.rend(); ++i)
+        insert(*i);
+}
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::orderSymbolsByProfile(const std::unordered_map<std::string_view, uint64_t> & profile)
+{
+    symbolProfile = &profile;
+
+    auto shdrDynsym = tryFindSectionHeader(".dynsym");
+    auto shdrDynStr = tryFindSectionHeader(".dynstr");
+    if (!shdrDynsym || !shdrDynStr) {
+        debug("no dynamic symbols to order\n");
+        return;
+    }
+
+    /* The tables are rebuilt again by any later change to the symbols,
+       which then keeps to the profile as well. */
+    auto strTab = getCurrentStrTab(*shdrDynStr);
+    auto dynsyms = getCurrentSectionSpan<Elf_Sym>(*shdrDynsym);
+    debug("ordering dynamic symbols by a profile of %zu symbols\n", profile.size());
+    rebuildGnuHashTable(strTab, dynsyms);
+    rebuildHashTable(strTab, dynsyms);
+    changed = true;
+}
+
+/* How well a hash table spreads its symbols, for --print-hash-stats. */
+struct HashTableStats
+{
+    const char * name;
+    size_t symbols = 0;
+    /* How many buckets have a chain of each length. */
+    std::vector<size_t> chainLengths;
+    /* The Bloom filter of a .gnu.hash table; no words for .hash. */
+    size_t bloomWords = 0, bloomBits = 0, bloomBitsSet = 0;
+    unsigned int shift2 = 0;
+    double falsePositiveRate = 1;
+
+    explicit HashTableStats(const char * sectionName) : name(sectionName) { }
+
+    size_t buckets() const
+    {
+        return std::accumulate(chainLengths.begin(), chainLengths.end(), size_t(0));
+    }
+
+    /* Entries compared on average to find a symbol that is there, and
+       one that is not (and got past the Bloom filter, if any). */
+    double successfulProbes() const
+    {
+        size_t probes = 0;
+        for (size_t len = 0; len < chainLengths.size(); ++len)
+            probes += chainLengths[len] * len * (len + 1) / 2;
+        return symbols ? double(probes) / symbols : 0;
+    }
+
+    double failedProbes() const
+    {
+        return falsePositiveRate * symbols / std::max<size_t>(buckets(), 1);
+    }
+
+    void addChain(size_t len)
+    {
+        if (chainLengths.size() <= len)
+            chainLengths.resize(len + 1);
+        chainLengths[len]++;
+        symbols += len;
+    }
+};
+
+static std::string jsonString(std::string_view s)
+{
+    std::string res = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            res += '\\';
+            res += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            res += buf;
+        } else
+            res += c;
+    }
+    return res + '"';
+}
+
+static void printHashTableStats(const HashTableStats & stats, bool json)
+{
+    auto buckets = stats.buckets();
+    auto empty = stats.chainLengths.empty() ? 0 : stats.chainLengths[0];
+
+    if (json) {
+        fprintf(outStream, "%s: {\"buckets\": %zu, \"symbols\": %zu, \"empty_buckets\": %zu, \"chain_lengths\": [",
+            jsonString(stats.name).c_str(), buckets, stats.symbols, empty);
+        for (size_t len = 0; len < stats.chainLengths.size(); ++len)
+            fprintf(outStream, "%s%zu", len ? ", " : "", stats.chainLengths[len]);
+        fprintf(outStream, "]");
+        if (stats.bloomWords)
+            fprintf(outStream, ", \"bloom_words\": %zu, \"bloom_shift\": %u, \"bloom_fill\": %.4f, \"false_positive_rate\": %.4f",
+                stats.bloomWords, stats.shift2, double(stats.bloomBitsSet) / stats.bloomBits, stats.falsePositiveRate);
+        fprintf(outStream, ", \"successful_lookup_probes\": %.4f, \"failed_lookup_probes\": %.4f}",
+            stats.successfulProbes(), stats.failedProbes());
+        return;
+    }
+
+    fprintf(outStream, "%s: %zu buckets, %zu symbols\n", stats.name, buckets, stats.symbols);
+    fprintf(outStream, "  empty buckets: %zu (%.1f%%)\n", empty, buckets ? 100.0 * empty / buckets : 0);
+    fprintf(outStream, "  chain length histogram:\n");
+    for (size_t len = 0; len < stats.chainLengths.size(); ++len)
+        if (stats.chainLengths[len])
+            fprintf(outStream, "  %6zu: %zu\n", len, stats.chainLengths[len]);
+    if (stats.bloomWords) {
+        fprintf(outStream, "  bloom filter: %zu words, shift %u, %.1f%% of bits set\n",
+            stats.bloomWords, stats.shift2, 100.0 * stats.bloomBitsSet / stats.bloomBits);
+        fprintf(outStream, "  bloom false-positive rate: %.2f%%\n", 100 * stats.falsePositiveRate);
     }
+    fprintf(outStream, "  probes per successful lookup: %.2f\n", stats.successfulProbes());
+    fprintf(outStream, "  probes per failed lookup: %.2f\n", stats.failedProbes());
 }
 
 template<ElfFileParams>
-void ElfFile<ElfFileParamNames>::renameDynamicSymbols(const std::unordered_map<std::string_view, std::string>& remap)
+void ElfFile<ElfFileParamNames>::printHashStats(bool json, const std::string & fileName)
 {
-    auto dynsyms = getSectionSpan<Elf_Sym>(".dynsym");
-    auto strTab = getSectionSpan<char>(".dynstr");
+    std::vector<HashTableStats> tables;
+
+    if (auto shdrGnuHash = tryFindSectionHeader(".gnu.hash")) {
+        auto ght = parseGnuHashTable(getSectionSpan<char>(*shdrGnuHash));
+        auto & stats = tables.emplace_back(".gnu.hash");
+        auto symndx = rdi(ght.m_hdr.symndx);
+        for (auto bucket : ght.m_buckets) {
+            size_t first = rdi(bucket), len = 0;
+            if (first != 0) {
+                if (first < symndx)
+                    error(".gnu.hash bucket out of range");
+                for (size_t i = first - symndx; i < ght.m_table.size(); ++i) {
+                    len++;
+                    if (rdi(ght.m_table[i]) & 1)
+                        break;
+                }
+            }
+            stats.addChain(len);
+        }
+
+        /* A symbol that is not there gets past the filter if both bits
+           it picks in its word are set. */
+        stats.bloomWords = ght.m_bloomFilters.size();
+        stats.bloomBits = stats.bloomWords * ElfClass;
+        stats.shift2 = rdi(ght.m_hdr.shift2);
+        double rate = 0;
+        for (auto word : ght.m_bloomFilters) {
+            size_t set = __builtin_popcountll(rdi(word));
+            stats.bloomBitsSet += set;
+            rate += double(set) * set;
+        }
+        stats.falsePositiveRate = rate / (double(stats.bloomWords) * ElfClass * ElfClass);
+    }
+
+    if (auto shdrHash = tryFindSectionHeader(".hash")) {
+        auto ht = parseHashTable(getSectionSpan<char>(*shdrHash));
+        auto & stats = tables.emplace_back(".hash");
+        for (auto bucket : ht.m_buckets) {
+            size_t len = 0;
+            for (size_t i = rdi(bucket); i != 0; i = rdi(ht.m_chain[i])) {
+                if (i >= ht.m_chain.size() || len == ht.m_chain.size())
+                    error(".hash chain out of range");
+                len++;
+            }
+            stats.addChain(len);
+        }
+    }
+
+    if (json) {
+        fprintf(outStream, "{\"file\": %s", jsonString(fileName).c_str());
+        for (auto & stats : tables) {
+            fprintf(outStream, ", ");
+            printHashTableStats(stats, true);
+        }
+        fprintf(outStream, "}\n");
+    } else {
+        for (auto & stats : tables)
+            printHashTableStats(stats, false);
+    }
+}
 
-    std::vector<char> extraStrings;
-    extraStrings.reserve(remap.size() * 30); // Just an estimate
-    for (auto& dynsym : dynsyms)
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::renameDynamicSymbols(const SymbolRenameMap & remap)
+{
+    auto dynsyms = getSectionSpan<Elf_Sym>(".dynsym");
+    const auto & shdrDynStr = findSectionHeader(".dynstr");
+
+    /* Look all names up before adding any, so that the string table
+       only grows once. */
+    auto strTab = getCurrentStrTab(shdrDynStr);
+    std::vector<size_t> renamedSyms;
+    std::vector<std::string_view> newNames;
+    for (size_t i = 0; i < dynsyms.size(); ++i)
     {
-        std::string_view name = &strTab[rdi(dynsym.st_name)];
-        auto it = remap.find(name);
-        if (it != remap.end())
+        const char * name = strTabEntry(strTab, rdi(dynsyms[i].st_name));
+        if (auto newName = remap.find(name))
         {
-            wri(dynsym.st_name, strTab.size() + extraStrings.size());
-            auto& newName = it->second;
-            debug("renaming dynamic symbol %s to %s\n", name.data(), it->second.c_str());
-            extraStrings.insert(extraStrings.end(), newName.begin(), newName.end() + 1);
-            changed = true;
+            debug("renaming dynamic symbol %s to %s\n", name, newName);
+            renamedSyms.push_back(i);
+            newNames.push_back(newName);
         } else {
-            debug("skip renaming dynamic symbol %sn", name.data());
+            debug("skip renaming dynamic symbol %s\n", name);
         }
     }
 
-    if (!extraStrings.empty())
-    {
-        auto newStrTabSize = strTab.size() + extraStrings.size();
-        auto& newSec = replaceSection(".dynstr", newStrTabSize);
-        auto newStrTabSpan = span(newSec.data(), newStrTabSize);
-
-        std::copy(extraStrings.begin(), extraStrings.end(), &newStrTabSpan[strTab.size()]);
+    if (renamedSyms.empty())
+        return;
 
-        rebuildGnuHashTable(newStrTabSpan, dynsyms);
-        rebuildHashTable(newStrTabSpan, dynsyms);
-    }
+    auto offsets = addStrings(".dynstr", newNames);
+    for (size_t i = 0; i < renamedSyms.size(); ++i)
+        wri(dynsyms[renamedSyms[i]].st_name, offsets[i]);
+    markDirty(findSectionHeader(".dynsym"));
+    changed = true;
 
-    this->rewriteSections();
+    strTab = getCurrentStrTab(shdrDynStr);
+    rebuildGnuHashTable(strTab, dynsyms);
+    rebuildHashTable(strTab, dynsyms);
 }
 
 template<ElfFileParams>
@@ -2749,7 +4230,7 @@ void ElfFile<ElfFileParamNames>::clearSymbolVersions(const std::set<std::string>
     auto shdrDynsym = findSectionHeader(".dynsym");
     auto shdrVersym = findSectionHeader(".gnu.version");
 
-    auto strTab = getStrTab(shdrDynStr);
+    auto strTab = getCurrentStrTab(shdrDynStr);
     auto dynsyms = getSectionSpan<Elf_Sym>(shdrDynsym);
     auto versyms = getSectionSpan<Elf_Versym>(shdrVersym);
 
@@ -2762,10 +4243,10 @@ void ElfFile<ElfFileParamNames>::clearSymbolVersions(const std::set<std::string>
         if (syms.count(name)) {
             debug("clearing symbol version for %s\n", name);
             wri(versyms[i], 1);
+            markDirty(shdrVersym);
         }
     }
     changed = true;
-    this->rewriteSections();
 }
 
 template<ElfFileParams>
@@ -2788,12 +4269,14 @@ void ElfFile<ElfFileParamNames>::modifyExecstack(ExecstackMode op)
 
                 wri(header.p_flags, rdi(header.p_flags) & ~PF_X);
                 * ((Elf_Phdr *) (fileContents->data() + rdi(hdr()->e_phoff)) + i) = header;
+                markDirty(rdi(hdr()->e_phoff) + i * sizeof(Elf_Phdr), sizeof(Elf_Phdr));
                 changed = true;
             } else if (op == ExecstackMode::set && (rdi(header.p_flags) & PF_X) != PF_X) {
                 debug("simple execstack set of header %zu\n", i);
 
                 wri(header.p_flags, rdi(header.p_flags) | PF_X);
                 * ((Elf_Phdr *) (fileContents->data() + rdi(hdr()->e_phoff)) + i) = header;
+                markDirty(rdi(hdr()->e_phoff) + i * sizeof(Elf_Phdr), sizeof(Elf_Phdr));
                 changed = true;
             } else {
                 debug("execstack already in requested state\n");
@@ -2812,6 +4295,7 @@ void ElfFile<ElfFileParamNames>::modifyExecstack(ExecstackMode op)
             wri(header.p_align, 0x1);
 
             * ((Elf_Phdr *) (fileContents->data() + rdi(hdr()->e_phoff)) + nullhdr) = header;
+            markDirty(rdi(hdr()->e_phoff) + nullhdr * sizeof(Elf_Phdr), sizeof(Elf_Phdr));
             changed = true;
             return;
         }
@@ -2827,7 +4311,7 @@ void ElfFile<ElfFileParamNames>::modifyExecstack(ExecstackMode op)
         wri(hdr()->e_phnum, rdi(hdr()->e_phnum) + 1);
 
         changed = true;
-        rewriteSections(true);
+        forceRewrite = true;
         return;
     }
 
@@ -2844,30 +4328,37 @@ void ElfFile<ElfFileParamNames>::modifyExecstack(ExecstackMode op)
         break;
     }
 
-    printf("execstack: %c\n", result);
+    fprintf(outStream, "execstack: %c\n", result);
 }
 
 template<ElfFileParams>
 template<class StrIdxCallback>
 void ElfFile<ElfFileParamNames>::forAllStringReferences(const Elf_Shdr& strTabHdr, StrIdxCallback&& fn)
 {
-    for (auto& sym : tryGetSectionSpan<Elf_Sym>(".dynsym"))
+    auto shdrDynSym = tryFindSectionHeader(".dynsym");
+    for (auto& sym : shdrDynSym ? getCurrentSectionSpan<Elf_Sym>(*shdrDynSym) : span<Elf_Sym>())
         fn(sym.st_name);
 
-    for (auto& dyn : tryGetSectionSpan<Elf_Dyn>(".dynamic"))
+    auto shdrDynamic = tryFindSectionHeader(".dynamic");
+    for (auto& dyn : shdrDynamic ? getCurrentSectionSpan<Elf_Dyn>(*shdrDynamic) : span<Elf_Dyn>())
         switch (rdi(dyn.d_tag))
         {
             case DT_NEEDED:
             case DT_SONAME:
             case DT_RPATH:
-            case DT_RUNPATH: fn(dyn.d_un.d_val);
+            case DT_RUNPATH:
+            case DT_AUXILIARY:
+            case DT_FILTER:
+            case DT_CONFIG:
+            case DT_DEPAUDIT:
+            case DT_AUDIT: fn(dyn.d_un.d_val);
             default:;
         }
 
     if (auto verdHdr = tryFindSectionHeader(".gnu.version_d"))
     {
         if (&shdrs.at(rdi(verdHdr->get().sh_link)) == &strTabHdr)
-            forAll_ElfVer(getSectionSpan<char>(*verdHdr), (Elf_Verdef*)nullptr,
+            forAll_ElfVer(getCurrentSectionSpan<char>(*verdHdr), (Elf_Verdef*)nullptr,
                 [] (auto& /*vd*/) {},
                 [&] (auto& vda) { fn(vda.vda_name); }
             );
@@ -2876,126 +4367,708 @@ void ElfFile<ElfFileParamNames>::forAllStringReferences(const Elf_Shdr& strTabHd
     if (auto vernHdr = tryFindSectionHeader(".gnu.version_r"))
     {
         if (&shdrs.at(rdi(vernHdr->get().sh_link)) == &strTabHdr)
-            forAll_ElfVer(getSectionSpan<char>(*vernHdr), (Elf_Verneed*)nullptr,
+            forAll_ElfVer(getCurrentSectionSpan<char>(*vernHdr), (Elf_Verneed*)nullptr,
                 [&] (auto& vn) { fn(vn.vn_file); },
                 [&] (auto& vna) { fn(vna.vna_name); }
             );
     }
 }
 
-static bool printInterpreter = false;
-static bool printOsAbi = false;
-static bool setOsAbi = false;
-static std::string newOsAbi;
-static bool printSoname = false;
-static bool setSoname = false;
-static std::string newSoname;
-static std::string newInterpreter;
-static bool shrinkRPath = false;
-static std::vector<std::string> allowedRpathPrefixes;
-static bool removeRPath = false;
-static bool setRPath = false;
-static bool addRPath = false;
-static bool addDebugTag = false;
-static bool buildResolutionCache = false;
-static bool renameDynamicSymbols = false;
-static bool printRPath = false;
-static std::string newRPath;
-static std::set<std::string> neededLibsToRemove;
-static std::map<std::string, std::string> neededLibsToReplace;
-static std::set<std::string> neededLibsToAdd;
-static std::set<std::string> symbolsToClearVersion;
-static std::unordered_map<std::string_view, std::string> symbolsToRename;
-static std::unordered_set<std::string> symbolsToRenameKeys;
-static bool printNeeded = false;
-static bool noDefaultLib = false;
-static bool printExecstack = false;
-static bool clearExecstack = false;
-static bool setExecstack = false;
-
-template<class ElfFile>
-static void patchElf2(ElfFile && elfFile, const FileContents & fileContents, const std::string & fileName)
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::setSectionSize(unsigned int index, size_t size)
 {
-    if (printInterpreter)
-        printf("%s\n", elfFile.getInterpreter().c_str());
+    auto & shdr = shdrs.at(index);
+    wri(shdr.sh_size, size);
+    auto shoff = rdi(hdr()->e_shoff) + index * sizeof(Elf_Shdr);
+    checkOffset(fileContents, shoff, sizeof(Elf_Shdr));
+    memcpy(fileContents->data() + shoff, &shdr, sizeof(Elf_Shdr));
+    markDirty(shoff, sizeof(Elf_Shdr));
+}
 
-    if (printOsAbi)
-        elfFile.modifyOsAbi(elfFile.printOsAbi, "");
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::compactDynStr()
+{
+    auto shdrDynStrOpt = tryFindSectionHeader(".dynstr");
+    if (!shdrDynStrOpt) {
+        debug("no .dynstr section, nothing to compact\n");
+        return;
+    }
+    const auto & shdrDynStr = shdrDynStrOpt->get();
+    const unsigned int dynStrIndex = getSectionIndex(".dynstr");
 
-    if (setOsAbi)
-        elfFile.modifyOsAbi(elfFile.replaceOsAbi, newOsAbi);
+    /* Strings can only be moved if every reference to them is known,
+       i.e. comes from a section forAllStringReferences() looks at. */
+    auto refersToDynStr = [&](const Elf_Shdr & shdr) {
+        return rdi(shdr.sh_link) == dynStrIndex && rdi(shdr.sh_type) != SHT_NULL;
+    };
+    auto isVisited = [&](const Elf_Shdr & shdr) {
+        auto name = getSectionName(shdr);
+        return name == ".dynsym" || name == ".dynamic" || name == ".gnu.version_d" || name == ".gnu.version_r";
+    };
+    for (auto & shdr : shdrs)
+        if (refersToDynStr(shdr) && !isVisited(shdr))
+            error(fmt("cannot compact .dynstr: section '", getSectionName(shdr), "' refers to it"));
 
-    if (printSoname)
-        elfFile.modifySoname(elfFile.printSoname, "");
+    auto strTab = getCurrentStrTab(shdrDynStr);
 
-    if (setSoname)
-        elfFile.modifySoname(elfFile.replaceSoname, newSoname);
+    /* The strings still referenced, by their offset in the old table. */
+    std::map<size_t, std::string_view> live;
+    forAllStringReferences(shdrDynStr, [&] (auto & refIdx) {
+        auto idx = rdi(refIdx);
+        live.emplace(idx, strTabEntry(strTab, idx));
+    });
 
-    if (!newInterpreter.empty())
-        elfFile.setInterpreter(newInterpreter);
+    /* Put every string that is the tail of another one into that one.
+       In order of the reversed strings, such a string comes right
+       after the one holding it (or after another string it is also the
+       tail of). */
+    std::vector<std::string_view> byTail;
+    for (auto & [idx, str] : live)
+        if (!str.empty()) byTail.push_back(str);
+    std::sort(byTail.begin(), byTail.end(), [] (std::string_view a, std::string_view b) {
+        return std::lexicographical_compare(b.rbegin(), b.rend(), a.rbegin(), a.rend());
+    });
+    byTail.erase(std::unique(byTail.begin(), byTail.end()), byTail.end());
+
+    std::unordered_map<std::string_view, std::string_view> holder;
+    for (size_t i = 0; i < byTail.size(); ++i) {
+        auto & prev = i ? holder.at(byTail[i - 1]) : byTail[i];
+        bool isTail = i && prev.size() > byTail[i].size()
+            && prev.compare(prev.size() - byTail[i].size(), byTail[i].size(), byTail[i]) == 0;
+        holder.emplace(byTail[i], isTail ? prev : byTail[i]);
+    }
 
-    if (printRPath)
-        elfFile.modifyRPath(elfFile.rpPrint, {}, "");
+    /* Lay out the remaining strings in their old order, after the
+       empty string at offset 0 and the names of the symbols in the
+       profile, which thus share as few cache lines as they can. */
+    std::string newStrTab(1, '\0');
+    std::unordered_map<std::string_view, size_t> newIndex;
+    newIndex.emplace(std::string_view(), 0);
+    auto place = [&] (std::string_view str) {
+        if (str.empty() || newIndex.count(str)) return;
+        newIndex.emplace(str, newStrTab.size());
+        newStrTab += str;
+        newStrTab += '\0';
+    };
+    if (auto shdrDynSym = tryFindSectionHeader(".dynsym"))
+        if (&shdrs.at(rdi(shdrDynSym->get().sh_link)) == &shdrDynStr) {
+            auto dynsyms = getCurrentSectionSpan<Elf_Sym>(*shdrDynSym);
+            for (auto i : hotSymbols(strTab, dynsyms))
+                place(holder.at(strTabEntry(strTab, rdi(dynsyms[i].st_name))));
+        }
+    for (auto & [idx, str] : live)
+        if (!str.empty() && holder.at(str) == str)
+            place(str);
+    for (auto & [str, h] : holder)
+        if (h != str)
+            newIndex.emplace(str, newIndex.at(h) + h.size() - str.size());
+
+    debug(".dynstr: %d bytes, %d after compaction\n", strTab.size(), newStrTab.size());
+    if (newStrTab.size() > strTab.size()
+        || std::string_view(strTab.begin(), newStrTab.size()) == newStrTab)
+        return;
 
-    if (printExecstack)
-        elfFile.modifyExecstack(ElfFile::ExecstackMode::print);
-    else if (clearExecstack)
-        elfFile.modifyExecstack(ElfFile::ExecstackMode::clear);
-    else if (setExecstack)
-        elfFile.modifyExecstack(ElfFile::ExecstackMode::set);
+    forAllStringReferences(shdrDynStr, [&] (auto & refIdx) {
+        wri(refIdx, newIndex.at(strTabEntry(strTab, rdi(refIdx))));
+    });
+    strTabIndices.erase(".dynstr");
+    for (auto & shdr : shdrs)
+        if (isVisited(shdr))
+            markDirty(shdr);
+    changed = true;
 
-    if (shrinkRPath)
-        elfFile.modifyRPath(elfFile.rpShrink, allowedRpathPrefixes, "");
-    else if (removeRPath)
-        elfFile.modifyRPath(elfFile.rpRemove, {}, "");
-    else if (setRPath)
-        elfFile.modifyRPath(elfFile.rpSet, {}, newRPath);
-    else if (addRPath)
-        elfFile.modifyRPath(elfFile.rpAdd, {}, newRPath);
+    if (hasReplacedSection(".dynstr")) {
+        replaceSection(".dynstr", newStrTab.size()) = newStrTab;
+        return;
+    }
 
-    if (printNeeded) elfFile.printNeededLibs();
+    /* Otherwise shrink the table where it is, so that nothing has to
+       move.  The dead strings are zeroed, as the old rpath would be. */
+    memcpy(strTab.begin(), newStrTab.data(), newStrTab.size());
+    memset(strTab.begin() + newStrTab.size(), 0, strTab.size() - newStrTab.size());
+    markDirty(shdrDynStr);
 
-    elfFile.removeNeeded(neededLibsToRemove);
-    elfFile.replaceNeeded(neededLibsToReplace);
-    elfFile.addNeeded(neededLibsToAdd);
-    elfFile.clearSymbolVersions(symbolsToClearVersion);
+    setSectionSize(dynStrIndex, newStrTab.size());
 
-    if (noDefaultLib)
-        elfFile.noDefaultLib();
+    if (auto shdrDynamic = tryFindSectionHeader(".dynamic"))
+        for (auto & dyn : getCurrentSectionSpan<Elf_Dyn>(*shdrDynamic))
+            if (rdi(dyn.d_tag) == DT_STRSZ)
+                wri(dyn.d_un.d_val, newStrTab.size());
+}
 
-    if (addDebugTag)
-        elfFile.addDebugTag();
+/* How often each symbol is looked up, as read from --symbol-profile. */
+struct SymbolProfile
+{
+    std::unordered_map<std::string_view, uint64_t> counts;
+    std::unordered_set<std::string> names;
 
-    if (buildResolutionCache)
-        elfFile.buildResolutionCache();
+    SymbolProfile() = default;
 
-    if (renameDynamicSymbols)
-        elfFile.renameDynamicSymbols(symbolsToRename);
+    /* The keys of counts point into names. */
+    SymbolProfile(const SymbolProfile &) = delete;
+    SymbolProfile & operator=(const SymbolProfile &) = delete;
+};
 
-    if (elfFile.isChanged()){
-        writeFile(fileName, elfFile.fileContents);
-    } else if (alwaysWrite) {
-        debug("not modified, but alwaysWrite=true\n");
-        writeFile(fileName, fileContents);
+/* The operations to apply to a file, as given on the command line or on
+   a line of a --batch manifest. */
+struct PatchOptions
+{
+    bool printInterpreter = false;
+    bool printOsAbi = false;
+    bool setOsAbi = false;
+    std::string newOsAbi;
+    bool printSoname = false;
+    bool setSoname = false;
+    std::string newSoname;
+    std::string newInterpreter;
+    bool shrinkRPath = false;
+    std::vector<std::string> allowedRpathPrefixes;
+    bool removeRPath = false;
+    bool setRPath = false;
+    bool addRPath = false;
+    bool addDebugTag = false;
+    bool buildResolutionCache = false;
+    bool renameDynamicSymbols = false;
+    bool compactDynStr = false;
+    bool optimizeGnuHash = false;
+    bool printHashStats = false;
+    bool hashStatsJson = false;
+    bool printRPath = false;
+    std::string newRPath;
+    std::set<std::string> neededLibsToRemove;
+    std::map<std::string, std::string> neededLibsToReplace;
+    std::set<std::string> neededLibsToAdd;
+    std::set<std::string> symbolsToClearVersion;
+    std::shared_ptr<const SymbolRenameMap> symbolsToRename;
+    bool orderSymbolsByProfile = false;
+    std::shared_ptr<const SymbolProfile> symbolProfile;
+    bool printNeeded = false;
+    bool noDefaultLib = false;
+    bool printExecstack = false;
+    bool clearExecstack = false;
+    bool setExecstack = false;
+    std::string outputFileName;
+    bool alwaysWrite = false;
+
+    /* Whether these only ask questions about the file, so that they can
+       be answered from a partial read (see readFileHeaders()). */
+    [[nodiscard]] bool queryOnly() const
+    {
+        return !alwaysWrite && !setOsAbi && !setSoname && newInterpreter.empty()
+            && !shrinkRPath && !removeRPath && !setRPath && !addRPath
+            && neededLibsToRemove.empty() && neededLibsToReplace.empty() && neededLibsToAdd.empty()
+            && symbolsToClearVersion.empty() && !noDefaultLib && !addDebugTag
+            && !buildResolutionCache && !renameDynamicSymbols && !orderSymbolsByProfile
+            && !compactDynStr && !optimizeGnuHash
+            && !clearExecstack && !setExecstack;
     }
-}
+};
 
+/* The operations given on the command line, which apply to the files
+   named there and to those found with --recursive. */
+static std::shared_ptr<PatchOptions> commandLineOptions = std::make_shared<PatchOptions>();
 
-static void patchElf()
-{
-    for (const auto & fileName : fileNames) {
-        if (!printInterpreter && !printRPath && !printSoname && !printNeeded)
-            debug("patching ELF file '%s'\n", fileName.c_str());
+/* The same operations as written, to be applied to every line of a
+   --batch manifest before that line's own. */
+static std::vector<std::string> commandLineOperations;
 
-        auto fileContents = readFile(fileName);
-        const std::string & outputFileName2 = outputFileName.empty() ? fileName : outputFileName;
+/* A file listed in a --batch manifest, with its own operations. */
+struct BatchEntry
+{
+    std::string fileName;
+    std::shared_ptr<const PatchOptions> options;
+};
 
-        if (getElfType(fileContents).is32Bit)
-            patchElf2(ElfFile<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Nhdr, Elf32_Addr, Elf32_Off, Elf32_Dyn, Elf32_Sym, Elf32_Versym, Elf32_Verdef, Elf32_Verdaux, Elf32_Verneed, Elf32_Vernaux, Elf32_Rel, Elf32_Rela, 32>(fileContents), fileContents, outputFileName2);
-        else
-            patchElf2(ElfFile<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Nhdr, Elf64_Addr, Elf64_Off, Elf64_Dyn, Elf64_Sym, Elf64_Versym, Elf64_Verdef, Elf64_Verdaux, Elf64_Verneed, Elf64_Vernaux, Elf64_Rel, Elf64_Rela, 64>(fileContents), fileContents, outputFileName2);
-    }
-}
+static std::vector<BatchEntry> batchEntries;
+
+/* Write the patched 'contents' of 'inputFileName' to 'fileName', doing
+   as little I/O as the situation allows. */
+static void writeChanges(const PatchOptions & options, const std::string & inputFileName,
+    const std::string & fileName, const FileContents & contents, const DirtyRanges & dirty)
+{
+    /* Without --output we are updating the input file itself, whose
+       untouched bytes are already what we would write. */
+    if (options.outputFileName.empty() && writeFileInPlace(fileName, contents, dirty))
+        return;
+    if (!options.outputFileName.empty() && writeFileCloned(fileName, inputFileName, contents, dirty))
+        return;
+
+    /* Bytes that were moved would otherwise be read back from the input
+       after writeFile() has already overwritten them, if that is where
+       the output goes. */
+    if (dirty.hasInserts())
+        contents->detach();
+    writeFile(fileName, contents);
+}
+
+
+template<bool LittleEndian>
+using ElfFile32 = ElfFile<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Nhdr, Elf32_Addr, Elf32_Off, Elf32_Dyn, Elf32_Sym, Elf32_Versym, Elf32_Verdef, Elf32_Verdaux, Elf32_Verneed, Elf32_Vernaux, Elf32_Rel, Elf32_Rela, 32, LittleEndian>;
+
+template<bool LittleEndian>
+using ElfFile64 = ElfFile<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Nhdr, Elf64_Addr, Elf64_Off, Elf64_Dyn, Elf64_Sym, Elf64_Versym, Elf64_Verdef, Elf64_Verdaux, Elf64_Verneed, Elf64_Vernaux, Elf64_Rel, Elf64_Rela, 64, LittleEndian>;
+
+
+/* Call 'f' with an ElfFile for 'contents' of the right class and byte
+   order, so that the choice is made once per file rather than on every
+   field access. */
+template<class F>
+static void withElfFile(const FileContents & contents, F && f)
+{
+    auto elfType = getElfType(contents);
+    if (elfType.is32Bit) {
+        if (elfType.littleEndian)
+            f(ElfFile32<true>(contents));
+        else
+            f(ElfFile32<false>(contents));
+    } else {
+        if (elfType.littleEndian)
+            f(ElfFile64<true>(contents));
+        else
+            f(ElfFile64<false>(contents));
+    }
+}
+
+
+template<class ElfFile>
+static void patchElf2(const PatchOptions & options, ElfFile && elfFile,
+    const FileContents & fileContents, const std::string & inputFileName, const std::string & fileName)
+{
+    if (options.printInterpreter)
+        fprintf(outStream, "%s\n", elfFile.getInterpreter().c_str());
+
+    if (options.printOsAbi)
+        elfFile.modifyOsAbi(elfFile.printOsAbi, "");
+
+    if (options.setOsAbi)
+        elfFile.modifyOsAbi(elfFile.replaceOsAbi, options.newOsAbi);
+
+    if (options.printSoname)
+        elfFile.modifySoname(elfFile.printSoname, "");
+
+    if (options.setSoname)
+        elfFile.modifySoname(elfFile.replaceSoname, options.newSoname);
+
+    if (!options.newInterpreter.empty())
+        elfFile.setInterpreter(options.newInterpreter);
+
+    if (options.printRPath)
+        elfFile.modifyRPath(elfFile.rpPrint, {}, "");
+
+    if (options.printExecstack)
+        elfFile.modifyExecstack(ElfFile::ExecstackMode::print);
+    else if (options.clearExecstack)
+        elfFile.modifyExecstack(ElfFile::ExecstackMode::clear);
+    else if (options.setExecstack)
+        elfFile.modifyExecstack(ElfFile::ExecstackMode::set);
+
+    if (options.shrinkRPath)
+        elfFile.modifyRPath(elfFile.rpShrink, options.allowedRpathPrefixes, "");
+    else if (options.removeRPath)
+        elfFile.modifyRPath(elfFile.rpRemove, {}, "");
+    else if (options.setRPath)
+        elfFile.modifyRPath(elfFile.rpSet, {}, options.newRPath);
+    else if (options.addRPath)
+        elfFile.modifyRPath(elfFile.rpAdd, {}, options.newRPath);
+
+    if (options.printNeeded) elfFile.printNeededLibs();
+
+    if (options.printHashStats)
+        elfFile.printHashStats(options.hashStatsJson, inputFileName);
+
+    elfFile.removeNeeded(options.neededLibsToRemove);
+    elfFile.replaceNeeded(options.neededLibsToReplace);
+    elfFile.addNeeded(options.neededLibsToAdd);
+    elfFile.clearSymbolVersions(options.symbolsToClearVersion);
+
+    if (options.noDefaultLib)
+        elfFile.noDefaultLib();
+
+    if (options.addDebugTag)
+        elfFile.addDebugTag();
+
+    if (options.buildResolutionCache)
+        elfFile.buildResolutionCache();
+
+    /* First, so that the edits below that rebuild the hash tables
+       keep to the profile. */
+    if (options.orderSymbolsByProfile)
+        elfFile.orderSymbolsByProfile(options.symbolProfile->counts);
+
+    if (options.renameDynamicSymbols)
+        elfFile.renameDynamicSymbols(*options.symbolsToRename);
+
+    if (options.optimizeGnuHash)
+        elfFile.optimizeGnuHash();
+
+    /* Last, so that it also drops what the edits above left behind. */
+    if (options.compactDynStr)
+        elfFile.compactDynStr();
+
+    /* Lay out all the edits above in one go. */
+    elfFile.rewriteSections();
+
+    if (elfFile.isChanged()){
+        writeChanges(options, inputFileName, fileName, elfFile.fileContents, elfFile.dirtyRanges());
+    } else if (options.alwaysWrite) {
+        debug("not modified, but alwaysWrite=true\n");
+        writeChanges(options, inputFileName, fileName, fileContents, elfFile.dirtyRanges());
+    }
+}
+
+
+
+static void patchElfFile(const std::string & fileName, const PatchOptions & options)
+{
+    if (!options.printInterpreter && !options.printRPath && !options.printSoname && !options.printNeeded)
+        debug("patching ELF file '%s'\n", fileName.c_str());
+
+    auto fileContents = options.queryOnly() ? readFileHeaders(fileName) : readFile(fileName);
+    const std::string & outputFileName2 = options.outputFileName.empty() ? fileName : options.outputFileName;
+
+    withElfFile(fileContents, [&](auto && elfFile) {
+        patchElf2(options, std::move(elfFile), fileContents, fileName, outputFileName2);
+    });
+}
+
+
+#ifndef _WIN32
+/* Patches files on a pool of threads as they are added.  Of the files
+   waiting, the largest that keeps the combined size of the files in
+   flight below maxInFlightBytes is started first, so that big files do
+   not end up as a long tail.  Jobs that read or write the same file
+   (by device and inode, so also through another name) run one after the
+   other, in the order they were added, just as they would serially.
+   Output is collected per file and emitted in the order the files were
+   added.  As in the serial case, the first file (in that order) that
+   fails ends the run with its error, though files after it may already
+   have been patched. */
+class PatchPool
+{
+public:
+    explicit PatchPool(size_t threadCount)
+        : threadCount(threadCount)
+    {
+    }
+
+    PatchPool(const PatchPool &) = delete;
+    PatchPool & operator=(const PatchPool &) = delete;
+
+    ~PatchPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            pending.clear();
+        }
+        cond.notify_all();
+        for (auto & thread : threads)
+            thread.join();
+    }
+
+    /* Queue a file.  Returns false once a file has failed, after which
+       there is no point in adding more. */
+    bool add(const std::string & fileName, std::shared_ptr<const PatchOptions> options)
+    {
+        /* Errors are reported when the file is read. */
+        Job job{fileName, 0, std::move(options), {}, false, {}, {}, {}};
+        struct stat st;
+        if (stat(fileName.c_str(), &st) == 0) {
+            job.size = st.st_size;
+            job.files.emplace_back(st.st_dev, st.st_ino);
+        }
+        const auto & outputFileName = job.options->outputFileName;
+        if (!outputFileName.empty() && stat(outputFileName.c_str(), &st) == 0
+            && std::find(job.files.begin(), job.files.end(), FileId(st.st_dev, st.st_ino)) == job.files.end())
+            job.files.emplace_back(st.st_dev, st.st_ino);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        if (failure)
+            return false;
+        queue.push_back(std::move(job));
+        for (const auto & file : queue.back().files)
+            jobsByFile[file].push_back(queue.size() - 1);
+        pending.emplace(queue.back().size, queue.size() - 1);
+        cond.notify_all();
+        emit(lock, false);
+        return !failure;
+    }
+
+    void start()
+    {
+        while (threads.size() < threadCount)
+            threads.emplace_back([this] { work(); });
+    }
+
+    /* Wait for all files to be patched and emit their output. */
+    void finish()
+    {
+        start();
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            closed = true;
+            cond.notify_all();
+            emit(lock, true);
+        }
+        if (failure)
+            std::rethrow_exception(failure);
+    }
+
+private:
+    using FileId = std::pair<dev_t, ino_t>;
+    using PendingJobs = std::multimap<size_t, size_t, std::greater<size_t>>; /* size -> index in queue */
+
+    struct Job
+    {
+        std::string fileName;
+        size_t size;
+        std::shared_ptr<const PatchOptions> options;
+        std::vector<FileId> files; /* read or written */
+        bool done = false;
+        std::string out, err;
+        std::exception_ptr exception;
+    };
+
+    void work()
+    {
+        inPatchPool = true;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            if (pending.empty()) {
+                if (closed)
+                    return;
+                cond.wait(lock);
+                continue;
+            }
+
+            auto next = pickJob();
+            if (next == pending.end()) {
+                cond.wait(lock);
+                continue;
+            }
+            Job & job = queue[next->second];
+            pending.erase(next);
+            inFlight += job.size;
+            lock.unlock();
+
+            run(job);
+
+            lock.lock();
+            inFlight -= job.size;
+            job.done = true;
+            for (const auto & file : job.files) {
+                auto & jobs = jobsByFile[file];
+                jobs.pop_front();
+                if (jobs.empty())
+                    jobsByFile.erase(file);
+            }
+            cond.notify_all();
+        }
+    }
+
+    /* The largest pending job that fits into what is left of
+       maxInFlightBytes (any job does if nothing is in flight) and whose
+       files no earlier job still has to patch, or pending.end(). */
+    PendingJobs::iterator pickJob()
+    {
+        if (inFlight >= maxInFlightBytes)
+            return pending.end();
+        auto i = inFlight == 0 ? pending.begin() : pending.lower_bound(maxInFlightBytes - inFlight);
+        for (; i != pending.end(); ++i) {
+            const Job & job = queue[i->second];
+            if (std::all_of(job.files.begin(), job.files.end(), [&] (const FileId & file) {
+                    return jobsByFile[file].front() == i->second;
+                }))
+                break;
+        }
+        return i;
+    }
+
+    void run(Job & job)
+    {
+        char * outBuf = nullptr, * errBuf = nullptr;
+        size_t outLen = 0, errLen = 0;
+        outStream = open_memstream(&outBuf, &outLen);
+        errStream = open_memstream(&errBuf, &errLen);
+
+        if (outStream && errStream) {
+            try {
+                patchElfFile(job.fileName, *job.options);
+            } catch (...) {
+                job.exception = std::current_exception();
+            }
+        } else
+            job.exception = std::make_exception_ptr(SysError("open_memstream"));
+
+        if (outStream) fclose(outStream);
+        if (errStream) fclose(errStream);
+        if (outBuf) job.out.assign(outBuf, outLen);
+        if (errBuf) job.err.assign(errBuf, errLen);
+        free(outBuf);
+        free(errBuf);
+        outStream = stdout;
+        errStream = stderr;
+    }
+
+    /* Emit the output of files that are done, in order.  With 'wait',
+       keep going until all files are done. */
+    void emit(std::unique_lock<std::mutex> & lock, bool wait)
+    {
+        while (!failure && emitted < queue.size()) {
+            Job & job = queue[emitted];
+            if (!job.done) {
+                if (!wait)
+                    return;
+                cond.wait(lock);
+                continue;
+            }
+            fwrite(job.out.data(), 1, job.out.size(), stdout);
+            fwrite(job.err.data(), 1, job.err.size(), stderr);
+            if (job.exception) {
+                failure = job.exception;
+                pending.clear();
+            }
+            job.out = job.err = {};
+            ++emitted;
+        }
+    }
+
+    const size_t threadCount;
+    std::vector<std::thread> threads;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<Job> queue;
+    PendingJobs pending;
+    std::map<FileId, std::deque<size_t>> jobsByFile; /* indices of the unfinished jobs per file */
+    size_t inFlight = 0;
+    size_t emitted = 0;
+    bool closed = false;
+    std::exception_ptr failure;
+};
+
+
+/* Whether 'name' in 'dirFd' looks like a file getElfType() accepts,
+   judging from its first few bytes. */
+static bool sniffElfFile(int dirFd, const char * name, const struct stat & st)
+{
+    if (static_cast<uint64_t>(st.st_size) < sizeof(Elf32_Ehdr))
+        return false;
+
+    int fd = openat(dirFd, name, O_RDONLY | O_NOFOLLOW | O_BINARY);
+    if (fd == -1)
+        return false;
+
+    unsigned char ident[EI_NIDENT];
+    bool isElf = pread(fd, ident, sizeof ident, 0) == sizeof ident && !checkElfIdent(ident);
+    close(fd);
+    return isElf;
+}
+
+
+/* Call 'visit' for each ELF file below the directory 'dirFd' (which is
+   taken over), in sorted order.  Symlinks are not followed and every
+   file is visited only once, even if it has several hard links.  Stops
+   and returns false as soon as 'visit' does. */
+static bool walkElfFiles(int dirFd, const std::string & path, std::set<std::pair<dev_t, ino_t>> & seen,
+    const std::function<bool(const std::string &)> & visit)
+{
+    struct DirCloser { void operator()(DIR * dir) const { closedir(dir); } };
+    std::unique_ptr<DIR, DirCloser> dir(fdopendir(dirFd));
+    if (!dir) {
+        close(dirFd);
+        throw SysError(fmt("opening directory '", path, "'"));
+    }
+
+    std::vector<std::string> names;
+    while (auto * entry = readdir(dir.get())) {
+        std::string_view name = entry->d_name;
+        if (name != "." && name != "..")
+            names.emplace_back(name);
+    }
+    std::sort(names.begin(), names.end());
+
+    for (auto & name : names) {
+        std::string entryPath = path == "/" ? path + name : path + "/" + name;
+
+        struct stat st;
+        if (fstatat(dirfd(dir.get()), name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0)
+            throw SysError(fmt("getting info about '", entryPath, "'"));
+
+        if (!seen.emplace(st.st_dev, st.st_ino).second)
+            continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            int subFd = openat(dirfd(dir.get()), name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (subFd == -1)
+                throw SysError(fmt("opening directory '", entryPath, "'"));
+            if (!walkElfFiles(subFd, entryPath, seen, visit))
+                return false;
+        } else if (S_ISREG(st.st_mode) && sniffElfFile(dirfd(dir.get()), name.c_str(), st)) {
+            if (!visit(entryPath))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+
+static bool walkElfFiles(std::string path, const std::function<bool(const std::string &)> & visit)
+{
+    while (path.size() > 1 && path.back() == '/')
+        path.pop_back();
+
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+        throw SysError(fmt("opening directory '", path, "'"));
+
+    std::set<std::pair<dev_t, ino_t>> seen;
+    return walkElfFiles(fd, path, seen, visit);
+}
+#endif
+
+
+static void patchElf()
+{
+#ifndef _WIN32
+    if (jobs > 1 && (fileNames.size() + batchEntries.size() > 1 || !recursiveDirs.empty())) {
+        PatchPool pool(jobs);
+
+        /* Explicitly named files are all known up front, so schedule
+           them together before starting; directories are patched while
+           they are still being walked. */
+        bool accepted = true;
+        for (const auto & fileName : fileNames)
+            accepted = accepted && pool.add(fileName, commandLineOptions);
+        for (const auto & entry : batchEntries)
+            accepted = accepted && pool.add(entry.fileName, entry.options);
+        pool.start();
+
+        for (const auto & dir : recursiveDirs)
+            accepted = accepted && walkElfFiles(dir, [&] (const std::string & fileName) {
+                return pool.add(fileName, commandLineOptions);
+            });
+
+        pool.finish();
+        return;
+    }
+#endif
+
+    for (const auto & fileName : fileNames)
+        patchElfFile(fileName, *commandLineOptions);
+
+    for (const auto & entry : batchEntries)
+        patchElfFile(entry.fileName, *entry.options);
+
+#ifndef _WIN32
+    for (const auto & dir : recursiveDirs)
+        walkElfFiles(dir, [&] (const std::string & fileName) {
+            patchElfFile(fileName, *commandLineOptions);
+            return true;
+        });
+#endif
+}
 
 [[nodiscard]] static std::string resolveArgument(const char *arg) {
   if (strlen(arg) > 0 && arg[0] == '@') {
@@ -3037,14 +5110,531 @@ static void showHelp(const std::string & progName)
   [--clear-execstack]\n\
   [--set-execstack]\n\
   [--rename-dynamic-symbols NAME_MAP_FILE]\tRenames dynamic symbols. The map file should contain two symbols (old_name new_name) per line\n\
+  [--compile-rename-map NAME_MAP_FILE OUTPUT_FILE]\tWrites the map in a form that --rename-dynamic-symbols uses without parsing it.\n\
+  [--compact-dynstr]\t\tDrops strings no longer referenced from .dynstr.\n\
+  [--optimize-gnu-hash]\t\tResizes the .gnu.hash table to fit the symbols it holds.\n\
+  [--symbol-profile PROFILE_FILE]\tPuts the symbols looked up most often first in their hash chains. The profile file should contain a symbol name and a count per line\n\
+  [--print-hash-stats FORMAT]\tPrints how well the hash tables spread their symbols, as 'text' or 'json'.\n\
   [--no-clobber-old-sections]\t\tDo not clobber old section values - only use when the binary expects to find section info at the old location.\n\
   [--output FILE]\n\
+  [--jobs N]\t\tPatch up to N files at the same time.\n\
+  [--recursive DIR]\t\tPatch all ELF files found below DIR.\n\
+  [--batch MANIFEST]\t\tPatch the files listed in MANIFEST, each with the operations given on its line after those on the command line.\n\
   [--debug]\n\
   [--version]\n\
   FILENAME...\n", progName.c_str());
 }
 
 
+/* A compiled rename map starts with this header, followed by the
+   displacement of each bucket, the offset of the old name in each slot
+   (or emptySlot) and then the strings, each old name followed by its new
+   one. All numbers are in the byte order of the machine that wrote it. */
+struct RenameMapHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t numEntries;
+    uint32_t numBuckets;
+    uint32_t numSlots;
+    uint32_t stringsSize;
+    uint32_t reserved;
+};
+
+
+static constexpr char renameMapMagic[8] = { 'P', 'E', 'R', 'E', 'N', 'A', 'M', 'E' };
+static constexpr uint32_t renameMapVersion = 1;
+static constexpr uint32_t emptySlot = std::numeric_limits<uint32_t>::max();
+
+
+/* FNV-1a over the bytes of a NUL-terminated name, which thus gives the
+   same result on every machine, and its length. */
+static uint64_t renameMapHash(const char * name, size_t & len)
+{
+    uint64_t h = 0xcbf29ce484222325;
+    const char * p = name;
+    for (; *p; ++p)
+        h = (h ^ static_cast<uint8_t>(*p)) * 0x100000001b3;
+    len = p - name;
+    return h;
+}
+
+
+/* The slot of a name with hash 'h' in a bucket with displacement 'd'. */
+static uint64_t renameMapSlot(uint64_t h, uint32_t d)
+{
+    h += d * 0x9e3779b97f4a7c15;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccd;
+    h ^= h >> 33;
+    return h;
+}
+
+
+std::shared_ptr<const SymbolRenameMap> SymbolRenameMap::load(const std::string & fileName)
+{
+    FileContents contents;
+    try {
+        contents = readFile(fileName);
+    } catch (SysError &) {
+        error(fmt("Cannot open map file ", fileName));
+    }
+    if (contents->size() < sizeof(RenameMapHeader)
+        || memcmp(contents->data(), renameMapMagic, sizeof(renameMapMagic)) != 0)
+        return parse(fileName, contents);
+
+    auto hdr = reinterpret_cast<const RenameMapHeader *>(contents->data());
+    if (hdr->version != renameMapVersion)
+        error(fmt(fileName, ": unsupported version of a compiled rename map"));
+    uint64_t size = sizeof(*hdr) + (uint64_t(hdr->numBuckets) + hdr->numSlots) * sizeof(uint32_t) + hdr->stringsSize;
+    if (hdr->numBuckets == 0 || hdr->numSlots == 0 || size != contents->size()
+        || hdr->stringsSize == 0 || contents->data()[size - 1] != '\0')
+        error(fmt(fileName, ": compiled rename map is corrupt"));
+
+    auto map = std::make_shared<SymbolRenameMap>();
+    map->contents = contents;
+    return map;
+}
+
+
+/* Read a text map: each line has an old and a new name, separated by
+   white space. The map ends at the first empty line. */
+std::shared_ptr<const SymbolRenameMap> SymbolRenameMap::parse(const std::string & fileName, const FileContents & text)
+{
+    auto p = reinterpret_cast<const char *>(text->data());
+    auto end = p + text->size();
+    auto isSpace = [](char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f'; };
+    auto token = [&](const char * & q, const char * lineEnd) {
+        while (q != lineEnd && isSpace(*q)) ++q;
+        auto start = q;
+        while (q != lineEnd && !isSpace(*q)) ++q;
+        return std::string_view(start, q - start);
+    };
+
+    std::vector<std::pair<std::string_view, std::string_view>> entries;
+    std::unordered_set<std::string_view> seen;
+    for (size_t lineCount = 1; p != end; ++lineCount) {
+        auto lineEnd = static_cast<const char *>(memchr(p, '\n', end - p));
+        if (!lineEnd) lineEnd = end;
+        auto from = token(p, lineEnd);
+        if (from.empty())
+            break;
+        auto to = token(p, lineEnd);
+        if (to.empty())
+            error(fmt(fileName, ":", lineCount, ": Map file line is missing the second element"));
+        if (!seen.insert(from).second)
+            error(fmt(fileName, ":", lineCount, ": Name '", from, "' appears twice in the map file"));
+        if (from.find('@') != std::string_view::npos || to.find('@') != std::string_view::npos)
+            error(fmt(fileName, ":", lineCount, ": Name pair contains version tag: ", from, " ", to));
+        entries.emplace_back(from, to);
+        p = lineEnd == end ? end : lineEnd + 1;
+    }
+
+    return build(entries);
+}
+
+
+/* Hash and displace: the names are spread over buckets of about four,
+   and then, the largest buckets first, each bucket gets the first
+   displacement that puts all of its names into free slots. With a
+   fifth of the slots left over, that is found after a few tries. */
+std::shared_ptr<const SymbolRenameMap> SymbolRenameMap::build(
+    const std::vector<std::pair<std::string_view, std::string_view>> & entries)
+{
+    RenameMapHeader hdr{};
+    memcpy(hdr.magic, renameMapMagic, sizeof(hdr.magic));
+    hdr.version = renameMapVersion;
+    hdr.numEntries = entries.size();
+    hdr.numBuckets = std::max<size_t>(entries.size() / 4, 1);
+    hdr.numSlots = std::max<size_t>(entries.size() + entries.size() / 4, 1);
+
+    std::string strings;
+    std::vector<uint32_t> offsets;
+    std::vector<uint64_t> hashes;
+    for (auto & [from, to] : entries) {
+        offsets.push_back(strings.size());
+        strings.append(from);
+        strings += '\0';
+        size_t len;
+        hashes.push_back(renameMapHash(strings.c_str() + offsets.back(), len));
+        strings.append(to);
+        strings += '\0';
+    }
+    if (strings.empty())
+        strings += '\0';
+    if (strings.size() >= emptySlot)
+        error("rename map is too large");
+    hdr.stringsSize = strings.size();
+
+    std::vector<std::vector<uint32_t>> buckets(hdr.numBuckets);
+    for (uint32_t i = 0; i < entries.size(); ++i)
+        buckets[(hashes[i] >> 32) % hdr.numBuckets].push_back(i);
+    std::vector<uint32_t> order(hdr.numBuckets);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return buckets[a].size() > buckets[b].size();
+    });
+
+    std::vector<uint32_t> displacements(hdr.numBuckets), slots(hdr.numSlots, emptySlot), taken;
+    for (auto b : order) {
+        if (buckets[b].empty())
+            break;
+        for (uint32_t d = 0; ; ++d) {
+            if (d == (uint32_t(1) << 24))
+                error("cannot build a perfect hash table for the rename map");
+            taken.clear();
+            for (auto i : buckets[b]) {
+                auto slot = renameMapSlot(hashes[i], d) % hdr.numSlots;
+                if (slots[slot] != emptySlot)
+                    break;
+                slots[slot] = offsets[i];
+                taken.push_back(slot);
+            }
+            if (taken.size() == buckets[b].size()) {
+                displacements[b] = d;
+                break;
+            }
+            for (auto slot : taken)
+                slots[slot] = emptySlot;
+        }
+    }
+
+    auto contents = std::make_shared<FileBuffer>(sizeof(hdr)
+        + (displacements.size() + slots.size()) * sizeof(uint32_t) + strings.size());
+    auto out = contents->data();
+    memcpy(out, &hdr, sizeof(hdr));
+    out += sizeof(hdr);
+    memcpy(out, displacements.data(), displacements.size() * sizeof(uint32_t));
+    out += displacements.size() * sizeof(uint32_t);
+    memcpy(out, slots.data(), slots.size() * sizeof(uint32_t));
+    out += slots.size() * sizeof(uint32_t);
+    memcpy(out, strings.data(), strings.size());
+
+    auto map = std::make_shared<SymbolRenameMap>();
+    map->contents = contents;
+    return map;
+}
+
+
+/* Unlike writeFile(), this writes a data file, so it is created without
+   execute permission.  As there, the map may still be a mapping of the
+   file it is written to, so the file is only truncated at the end. */
+void SymbolRenameMap::save(const std::string & fileName) const
+{
+    debug("writing %s\n", fileName.c_str());
+
+    int fd = open(fileName.c_str(), O_CREAT | O_WRONLY | O_BINARY, 0666);
+    if (fd == -1)
+        throw SysError(fmt("opening '", fileName, "'"));
+
+    size_t bytesWritten = 0;
+    while (bytesWritten < contents->size()) {
+        ssize_t portion = write(fd, contents->data() + bytesWritten, contents->size() - bytesWritten);
+        if (portion < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            throw SysError(fmt("writing '", fileName, "'"));
+        }
+        bytesWritten += portion;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && ftruncate(fd, contents->size()) != 0) {
+        close(fd);
+        throw SysError(fmt("truncating '", fileName, "'"));
+    }
+
+    if (close(fd) != 0 && errno != EINTR)
+        throw SysError(fmt("writing '", fileName, "'"));
+}
+
+
+size_t SymbolRenameMap::size() const
+{
+    return reinterpret_cast<const RenameMapHeader *>(contents->data())->numEntries;
+}
+
+
+const char * SymbolRenameMap::find(const char * name) const
+{
+    auto hdr = reinterpret_cast<const RenameMapHeader *>(contents->data());
+    if (hdr->numEntries == 0)
+        return nullptr;
+
+    size_t len;
+    uint64_t h = renameMapHash(name, len);
+    auto displacements = reinterpret_cast<const uint32_t *>(hdr + 1);
+    auto slots = displacements + hdr->numBuckets;
+    auto strings = reinterpret_cast<const char *>(slots + hdr->numSlots);
+
+    uint32_t offset = slots[renameMapSlot(h, displacements[(h >> 32) % hdr->numBuckets]) % hdr->numSlots];
+    if (offset == emptySlot || offset + len + 1 >= uint64_t(hdr->stringsSize)
+        || memcmp(strings + offset, name, len + 1) != 0)
+        return nullptr;
+    return strings + offset + len + 1;
+}
+
+
+/* The rename maps read so far, so that a map named for many files, e.g.
+   on every line of a --batch manifest, is only read once. */
+static std::map<std::string, std::shared_ptr<const SymbolRenameMap>> renameMaps;
+
+static std::shared_ptr<const SymbolRenameMap> loadRenameMap(const std::string & fileName)
+{
+    auto & map = renameMaps[fileName];
+    if (!map) {
+        map = SymbolRenameMap::load(fileName);
+        debug("read %zu names to rename from %s\n", map->size(), fileName.c_str());
+    }
+    return map;
+}
+
+
+/* Read a --symbol-profile file. Each line has a symbol name and how
+   often it is looked up, separated by white space; the counts of a name
+   that appears more than once are added up. A line as printed with
+   LD_DEBUG=bindings counts as one lookup of the symbol it binds, and
+   the rest of that output is skipped, so it can be used as it is.
+   Empty lines and lines starting with '#' are ignored. */
+static void readSymbolProfile(SymbolProfile & profile, const std::string & fname)
+{
+    std::ifstream infile(fname);
+    if (!infile) error(fmt("cannot open symbol profile ", fname));
+
+    std::string line, name;
+    size_t lineCount = 0;
+    while (std::getline(infile, line)) {
+        lineCount++;
+        uint64_t count = 1;
+        if (auto binding = line.find("symbol `"); binding != std::string::npos) {
+            auto start = binding + 8, end = line.find('\'', start);
+            if (end == std::string::npos)
+                error(fmt(fname, ":", lineCount, ": unterminated symbol name"));
+            name = line.substr(start, end - start);
+            if (name.empty())
+                continue;
+        } else {
+            std::istringstream iss(line);
+            /* Other LD_DEBUG output, which starts with the process ID. */
+            if (!(iss >> name) || name[0] == '#' || name.back() == ':')
+                continue;
+            if (!(iss >> count))
+                error(fmt(fname, ":", lineCount, ": expected a symbol name and a count"));
+        }
+        if (name.find('@') != std::string::npos)
+            error(fmt(fname, ":", lineCount, ": symbol name contains a version tag: ", name));
+        profile.counts[*profile.names.insert(name).first] += count;
+    }
+}
+
+
+/* The profiles read so far, by the profile given before on the same
+   command line or manifest line (if any) and the file name, so that a
+   profile named for many files, e.g. on every line of a --batch
+   manifest, is only read once. */
+static std::map<std::pair<const SymbolProfile *, std::string>, std::shared_ptr<const SymbolProfile>> symbolProfiles;
+
+/* The profile 'previous' with the counts from 'fileName' added. */
+static std::shared_ptr<const SymbolProfile> loadSymbolProfile(
+    const std::shared_ptr<const SymbolProfile> & previous, const std::string & fileName)
+{
+    auto & profile = symbolProfiles[{previous.get(), fileName}];
+    if (!profile) {
+        auto newProfile = std::make_shared<SymbolProfile>();
+        if (previous)
+            for (auto & [name, count] : previous->counts)
+                newProfile->counts[*newProfile->names.emplace(name).first] += count;
+        readSymbolProfile(*newProfile, fileName);
+        debug("read lookup counts of %zu symbols from %s\n", newProfile->counts.size(), fileName.c_str());
+        profile = std::move(newProfile);
+    }
+    return profile;
+}
+
+
+/* Parse the operation at argv[i], advancing 'i' past its arguments.
+   Returns false if argv[i] is not an operation. */
+static bool parseOperation(PatchOptions & options, int argc, char * * argv, int & i)
+{
+    std::string arg(argv[i]);
+    if (arg == "--set-interpreter" || arg == "--interpreter") {
+        if (++i == argc) error("missing argument");
+        options.newInterpreter = resolveArgument(argv[i]);
+    }
+    else if (arg == "--print-interpreter") {
+        options.printInterpreter = true;
+    }
+    else if (arg == "--print-os-abi") {
+        options.printOsAbi = true;
+    }
+    else if (arg == "--set-os-abi") {
+        if (++i == argc) error("missing argument");
+        options.setOsAbi = true;
+        options.newOsAbi = resolveArgument(argv[i]);
+    }
+    else if (arg == "--print-soname") {
+        options.printSoname = true;
+    }
+    else if (arg == "--set-soname") {
+        if (++i == argc) error("missing argument");
+        options.setSoname = true;
+        options.newSoname = resolveArgument(argv[i]);
+    }
+    else if (arg == "--remove-rpath") {
+        options.removeRPath = true;
+    }
+    else if (arg == "--shrink-rpath") {
+        options.shrinkRPath = true;
+    }
+    else if (arg == "--allowed-rpath-prefixes") {
+        if (++i == argc) error("missing argument");
+        options.allowedRpathPrefixes = splitColonDelimitedString(argv[i]);
+    }
+    else if (arg == "--set-rpath") {
+        if (++i == argc) error("missing argument");
+        options.setRPath = true;
+        options.newRPath = resolveArgument(argv[i]);
+    }
+    else if (arg == "--add-rpath") {
+        if (++i == argc) error("missing argument");
+        options.addRPath = true;
+        options.newRPath = resolveArgument(argv[i]);
+    }
+    else if (arg == "--print-rpath") {
+        options.printRPath = true;
+    }
+    else if (arg == "--print-needed") {
+        options.printNeeded = true;
+    }
+    else if (arg == "--add-needed") {
+        if (++i == argc) error("missing argument");
+        options.neededLibsToAdd.insert(resolveArgument(argv[i]));
+    }
+    else if (arg == "--remove-needed") {
+        if (++i == argc) error("missing argument");
+        options.neededLibsToRemove.insert(resolveArgument(argv[i]));
+    }
+    else if (arg == "--replace-needed") {
+        if (i+2 >= argc) error("missing argument(s)");
+        options.neededLibsToReplace[ argv[i+1] ] = argv[i+2];
+        i += 2;
+    }
+    else if (arg == "--clear-symbol-version") {
+        if (++i == argc) error("missing argument");
+        options.symbolsToClearVersion.insert(resolveArgument(argv[i]));
+    }
+    else if (arg == "--print-hash-stats") {
+        if (++i == argc) error("missing argument");
+        std::string format(argv[i]);
+        if (format != "text" && format != "json")
+            error(fmt("unknown hash stats format '", format, "', expected 'text' or 'json'"));
+        options.printHashStats = true;
+        options.hashStatsJson = format == "json";
+    }
+    else if (arg == "--print-execstack") {
+        options.printExecstack = true;
+    }
+    else if (arg == "--clear-execstack") {
+        options.clearExecstack = true;
+    }
+    else if (arg == "--set-execstack") {
+        options.setExecstack = true;
+    }
+    else if (arg == "--output") {
+        if (++i == argc) error("missing argument");
+        options.outputFileName = resolveArgument(argv[i]);
+        options.alwaysWrite = true;
+    }
+    else if (arg == "--no-default-lib") {
+        options.noDefaultLib = true;
+    }
+    else if (arg == "--add-debug-tag") {
+        options.addDebugTag = true;
+    }
+    else if (arg == "--build-resolution-cache") {
+        options.buildResolutionCache = true;
+    }
+    else if (arg == "--compact-dynstr") {
+        options.compactDynStr = true;
+    }
+    else if (arg == "--optimize-gnu-hash") {
+        options.optimizeGnuHash = true;
+    }
+    else if (arg == "--rename-dynamic-symbols") {
+        options.renameDynamicSymbols = true;
+        if (++i == argc) error("missing argument");
+        options.symbolsToRename = loadRenameMap(argv[i]);
+    }
+    else if (arg == "--symbol-profile") {
+        options.orderSymbolsByProfile = true;
+        if (++i == argc) error("missing argument");
+        options.symbolProfile = loadSymbolProfile(options.symbolProfile, argv[i]);
+    }
+    else
+        return false;
+
+    return true;
+}
+
+
+static void checkOptions(const PatchOptions & options)
+{
+    if (forceRPath && options.buildResolutionCache)
+        error("--build-resolution-cache cannot be combined with --force-rpath");
+
+    if (options.setRPath && options.addRPath)
+        error("--set-rpath option not allowed with --add-rpath");
+}
+
+
+/* Read a --batch manifest.  Each line names a file followed by the
+   operations to apply to it, written as on the command line, with tabs
+   between the fields so that they can contain spaces.  The operations
+   given on the command line come first.  Empty lines and lines starting
+   with '#' are ignored. */
+static void readBatchManifest(const std::string & manifestName)
+{
+    std::ifstream manifest(manifestName);
+    if (!manifest) error(fmt("cannot open batch manifest '", manifestName, "'"));
+
+    std::string line;
+    size_t lineCount = 0;
+    while (std::getline(manifest, line)) {
+        lineCount++;
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        std::vector<std::string> fields;
+        for (size_t start = 0, end; start <= line.size(); start = end + 1) {
+            end = std::min(line.find('\t', start), line.size());
+            fields.push_back(line.substr(start, end - start));
+        }
+
+        fields.insert(fields.begin() + 1, commandLineOperations.begin(), commandLineOperations.end());
+
+        std::vector<char *> args;
+        for (auto & field : fields)
+            args.push_back(field.data());
+        int argc = args.size();
+
+        auto options = std::make_shared<PatchOptions>();
+        try {
+            if (fields[0].empty())
+                error("missing filename");
+            for (int i = 1; i < argc; ++i)
+                if (!parseOperation(*options, argc, args.data(), i))
+                    error(fmt("unknown operation '", args[i], "'"));
+            checkOptions(*options);
+        } catch (std::exception & e) {
+            throw std::runtime_error(fmt(manifestName, ":", lineCount, ": ", e.what()));
+        }
+
+        batchEntries.push_back(BatchEntry{fields[0], std::move(options)});
+    }
+}
+
+
 static int mainWrapped(int argc, char * * argv)
 {
     if (argc <= 1) {
@@ -3055,60 +5645,22 @@ static int mainWrapped(int argc, char * * argv)
     if (getenv("PATCHELF_DEBUG") != nullptr)
         debugMode = true;
 
+    bool compiledRenameMap = false;
+
     int i;
     for (i = 1; i < argc; ++i) {
-        std::string arg(argv[i]);
-        if (arg == "--set-interpreter" || arg == "--interpreter") {
-            if (++i == argc) error("missing argument");
-            newInterpreter = resolveArgument(argv[i]);
+        int start = i;
+        if (parseOperation(*commandLineOptions, argc, argv, i)) {
+            commandLineOperations.insert(commandLineOperations.end(), argv + start, argv + i + 1);
+            continue;
         }
-        else if (arg == "--page-size") {
+
+        std::string arg(argv[i]);
+        if (arg == "--page-size") {
             if (++i == argc) error("missing argument");
             forcedPageSize = atoi(argv[i]);
             if (forcedPageSize <= 0) error("invalid argument to --page-size");
         }
-        else if (arg == "--print-interpreter") {
-            printInterpreter = true;
-        }
-        else if (arg == "--print-os-abi") {
-            printOsAbi = true;
-        }
-        else if (arg == "--set-os-abi") {
-            if (++i == argc) error("missing argument");
-            setOsAbi = true;
-            newOsAbi = resolveArgument(argv[i]);
-        }
-        else if (arg == "--print-soname") {
-            printSoname = true;
-        }
-        else if (arg == "--set-soname") {
-            if (++i == argc) error("missing argument");
-            setSoname = true;
-            newSoname = resolveArgument(argv[i]);
-        }
-        else if (arg == "--remove-rpath") {
-            removeRPath = true;
-        }
-        else if (arg == "--shrink-rpath") {
-            shrinkRPath = true;
-        }
-        else if (arg == "--allowed-rpath-prefixes") {
-            if (++i == argc) error("missing argument");
-            allowedRpathPrefixes = splitColonDelimitedString(argv[i]);
-        }
-        else if (arg == "--set-rpath") {
-            if (++i == argc) error("missing argument");
-            setRPath = true;
-            newRPath = resolveArgument(argv[i]);
-        }
-        else if (arg == "--add-rpath") {
-            if (++i == argc) error("missing argument");
-            addRPath = true;
-            newRPath = resolveArgument(argv[i]);
-        }
-        else if (arg == "--print-rpath") {
-            printRPath = true;
-        }
         else if (arg == "--force-rpath") {
             /* Generally we prefer to emit DT_RUNPATH instead of
                DT_RPATH, as the latter is obsolete.  However, there is
@@ -3123,80 +5675,34 @@ static int mainWrapped(int argc, char * * argv)
                added. */
             forceRPath = true;
         }
-        else if (arg == "--print-needed") {
-            printNeeded = true;
-        }
         else if (arg == "--no-sort") {
             noSort = true;
         }
-        else if (arg == "--add-needed") {
+        else if (arg == "--recursive") {
             if (++i == argc) error("missing argument");
-            neededLibsToAdd.insert(resolveArgument(argv[i]));
+#ifdef _WIN32
+            error("--recursive is not supported on this platform");
+#endif
+            recursiveDirs.push_back(resolveArgument(argv[i]));
         }
-        else if (arg == "--remove-needed") {
+        else if (arg == "--batch") {
             if (++i == argc) error("missing argument");
-            neededLibsToRemove.insert(resolveArgument(argv[i]));
+            batchManifests.push_back(resolveArgument(argv[i]));
         }
-        else if (arg == "--replace-needed") {
-            if (i+2 >= argc) error("missing argument(s)");
-            neededLibsToReplace[ argv[i+1] ] = argv[i+2];
-            i += 2;
-        }
-        else if (arg == "--clear-symbol-version") {
+        else if (arg == "--jobs") {
             if (++i == argc) error("missing argument");
-            symbolsToClearVersion.insert(resolveArgument(argv[i]));
-        }
-        else if (arg == "--print-execstack") {
-            printExecstack = true;
+            jobs = atoi(argv[i]);
+            if (jobs <= 0) error("invalid argument to --jobs");
         }
-        else if (arg == "--clear-execstack") {
-            clearExecstack = true;
-        }
-        else if (arg == "--set-execstack") {
-            setExecstack = true;
-        }
-        else if (arg == "--output") {
-            if (++i == argc) error("missing argument");
-            outputFileName = resolveArgument(argv[i]);
-            alwaysWrite = true;
+        else if (arg == "--compile-rename-map") {
+            if (i + 2 >= argc) error("missing argument(s)");
+            loadRenameMap(argv[i + 1])->save(argv[i + 2]);
+            compiledRenameMap = true;
+            i += 2;
         }
         else if (arg == "--debug") {
             debugMode = true;
         }
-        else if (arg == "--no-default-lib") {
-            noDefaultLib = true;
-        }
-        else if (arg == "--add-debug-tag") {
-            addDebugTag = true;
-        }
-        else if (arg == "--build-resolution-cache") {
-            buildResolutionCache = true;
-        }
-        else if (arg == "--rename-dynamic-symbols") {
-            renameDynamicSymbols = true;
-            if (++i == argc) error("missing argument");
-
-            const char* fname = argv[i];
-            std::ifstream infile(fname);
-            if (!infile) error(fmt("Cannot open map file ", fname));
-
-            std::string line, from, to;
-            size_t lineCount = 1;
-            while (std::getline(infile, line))
-            {
-                std::istringstream iss(line);
-                if (!(iss >> from))
-                    break;
-                if (!(iss >> to))
-                    error(fmt(fname, ":", lineCount, ": Map file line is missing the second element"));
-                if (symbolsToRenameKeys.count(from))
-                    error(fmt(fname, ":", lineCount, ": Name '", from, "' appears twice in the map file"));
-                if (from.find('@') != std::string_view::npos || to.find('@') != std::string_view::npos)
-                    error(fmt(fname, ":", lineCount, ": Name pair contains version tag: ", from, " ", to));
-                lineCount++;
-                symbolsToRename[*symbolsToRenameKeys.insert(from).first] = to;
-            }
-        }
         else if (arg == "--no-clobber-old-sections") {
             clobberOldSections = false;
         }
@@ -3213,16 +5719,20 @@ static int mainWrapped(int argc, char * * argv)
         }
     }
 
-    if (fileNames.empty()) error("missing filename");
+    /* Manifests are read once all options are known, since whether
+       --force-rpath was given matters for checking their records. */
+    for (const auto & manifestName : batchManifests)
+        readBatchManifest(manifestName);
 
-    if (forceRPath && buildResolutionCache)
-        error("--build-resolution-cache cannot be combined with --force-rpath");
+    if (fileNames.empty() && recursiveDirs.empty() && batchManifests.empty()) {
+        if (compiledRenameMap) return 0;
+        error("missing filename");
+    }
 
-    if (!outputFileName.empty() && fileNames.size() != 1)
-        error("--output option only allowed with single input file");
+    checkOptions(*commandLineOptions);
 
-    if (setRPath && addRPath)
-        error("--set-rpath option not allowed with --add-rpath");
+    if (!commandLineOptions->outputFileName.empty() && (fileNames.size() != 1 || !recursiveDirs.empty() || !batchEntries.empty()))
+        error("--output option only allowed with single input file");
 
     patchElf();
 
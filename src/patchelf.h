@@ -4,14 +4,140 @@
 #include <set>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 #include "elf.h"
 
-using FileContents = std::shared_ptr<std::vector<unsigned char>>;
+/* The bytes of a file being patched. Regular files are mapped privately
+   (copy-on-write), so reading them and editing them in place costs no copy
+   of the whole file. Where the platform allows it, resize() and insert()
+   keep it that way by moving pages to a new mapping rather than copying
+   their contents; otherwise the mapping is turned into an owned buffer. */
+class FileBuffer
+{
+public:
+    FileBuffer() = default;
+    explicit FileBuffer(size_t size) : buffer(size) {}
+    FileBuffer(const unsigned char * first, const unsigned char * last) : buffer(first, last) {}
+    FileBuffer(const FileBuffer &) = delete;
+    FileBuffer & operator=(const FileBuffer &) = delete;
+    ~FileBuffer();
+
+    /* Map the first 'size' bytes of 'fd'. Returns nullptr if the file
+       cannot be mapped, in which case the caller should read it instead. */
+    static std::shared_ptr<FileBuffer> map(int fd, size_t size);
+
+    /* A partial view of a 'size' byte file for read-only queries: address
+       space for the whole file is reserved, but nothing is read until
+       load() asks for it. Takes ownership of 'fd' on success. */
+    static std::shared_ptr<FileBuffer> view(int fd, size_t size);
+
+    [[nodiscard]] unsigned char * data() noexcept { return mapping ? mapping : buffer.data(); }
+    [[nodiscard]] const unsigned char * data() const noexcept { return mapping ? mapping : buffer.data(); }
+    [[nodiscard]] size_t size() const noexcept { return mapping ? mappingSize : buffer.size(); }
+    [[nodiscard]] bool isMapped() const noexcept { return mapping != nullptr; }
+    [[nodiscard]] bool isPartial() const noexcept { return viewFd != -1; }
+
+    /* Make sure the given byte range is present. Only partial views have
+       anything to do here; for everything else all bytes are present. */
+    void load(size_t offset, size_t size)
+    {
+        if (viewFd != -1) loadRange(offset, size);
+    }
+
+    void resize(size_t newSize, unsigned char fill = 0);
+
+    /* Insert 'size' zero bytes at 'offset'. */
+    void insert(size_t offset, size_t size);
 
-#define ElfFileParams class Elf_Ehdr, class Elf_Phdr, class Elf_Shdr, class Elf_Nhdr, class Elf_Addr, class Elf_Off, class Elf_Dyn, class Elf_Sym, class Elf_Versym, class Elf_Verdef, class Elf_Verdaux, class Elf_Verneed, class Elf_Vernaux, class Elf_Rel, class Elf_Rela, unsigned ElfClass
-#define ElfFileParamNames Elf_Ehdr, Elf_Phdr, Elf_Shdr, Elf_Nhdr, Elf_Addr, Elf_Off, Elf_Dyn, Elf_Sym, Elf_Versym, Elf_Verdef, Elf_Verdaux, Elf_Verneed, Elf_Vernaux, Elf_Rel, Elf_Rela, ElfClass
+    /* Turn a mapping into an owned buffer, so that the contents no longer
+       follow changes made to the file afterwards. */
+    void detach();
+
+private:
+    void loadRange(size_t offset, size_t size);
+    bool remapWithGap(size_t offset, size_t gap);
+
+    unsigned char * mapping = nullptr;
+    size_t mappingSize = 0;
+    std::vector<unsigned char> buffer;
+
+    int viewFd = -1;
+    std::vector<std::pair<size_t, size_t>> loadedRanges;
+};
+
+using FileContents = std::shared_ptr<FileBuffer>;
+
+/* The map of a --rename-dynamic-symbols, from old symbol names to new
+   ones. It is kept as a perfect hash table in one block of memory, which
+   is built from a text map or is the mapped contents of a file written
+   by save(), so that a compiled map is ready to use without parsing. */
+class SymbolRenameMap
+{
+public:
+    /* Read a map in either form. */
+    static std::shared_ptr<const SymbolRenameMap> load(const std::string & fileName);
+
+    void save(const std::string & fileName) const;
+
+    /* The new name of the symbol 'name', or nullptr if it keeps it. */
+    [[nodiscard]] const char * find(const char * name) const;
+
+    [[nodiscard]] size_t size() const;
+
+private:
+    static std::shared_ptr<const SymbolRenameMap> parse(const std::string & fileName, const FileContents & text);
+    static std::shared_ptr<const SymbolRenameMap> build(
+        const std::vector<std::pair<std::string_view, std::string_view>> & entries);
+
+    FileContents contents;
+};
+
+/* Byte ranges of a FileBuffer that may differ from the file it was read
+   from, and where the remaining bytes came from in that file. */
+class DirtyRanges
+{
+public:
+    /* 'size' bytes of the buffer at 'offset' are those at 'sourceOffset'
+       in the original file. */
+    struct Extent
+    {
+        size_t offset, sourceOffset, size;
+    };
+
+    explicit DirtyRanges(size_t sourceSize = 0)
+        : sourceSize(sourceSize)
+    {
+        if (sourceSize) extents.push_back({0, 0, sourceSize});
+    }
+
+    void add(size_t offset, size_t size)
+    {
+        if (size) ranges.emplace_back(offset, offset + size);
+    }
+
+    /* Record that 'size' new bytes were inserted at 'offset', moving
+       everything after it further into the file. */
+    void insert(size_t offset, size_t size);
+
+    [[nodiscard]] size_t originalSize() const noexcept { return sourceSize; }
+    [[nodiscard]] bool hasInserts() const noexcept { return inserted; }
+    [[nodiscard]] const std::vector<Extent> & sourceExtents() const noexcept { return extents; }
+
+    /* The ranges as sorted, non-overlapping [begin, end) pairs. */
+    [[nodiscard]] std::vector<std::pair<size_t, size_t>> merged() const;
+
+private:
+    size_t sourceSize;
+    bool inserted = false;
+    std::vector<std::pair<size_t, size_t>> ranges;
+    std::vector<Extent> extents;
+};
+
+#define ElfFileParams class Elf_Ehdr, class Elf_Phdr, class Elf_Shdr, class Elf_Nhdr, class Elf_Addr, class Elf_Off, class Elf_Dyn, class Elf_Sym, class Elf_Versym, class Elf_Verdef, class Elf_Verdaux, class Elf_Verneed, class Elf_Vernaux, class Elf_Rel, class Elf_Rela, unsigned ElfClass, bool LittleEndian
+#define ElfFileParamNames Elf_Ehdr, Elf_Phdr, Elf_Shdr, Elf_Nhdr, Elf_Addr, Elf_Off, Elf_Dyn, Elf_Sym, Elf_Versym, Elf_Verdef, Elf_Verdaux, Elf_Verneed, Elf_Vernaux, Elf_Rel, Elf_Rela, ElfClass, LittleEndian
 
 template<class T>
 struct span
@@ -45,24 +171,67 @@ private:
     std::vector<Elf_Phdr> phdrs;
     std::vector<Elf_Shdr> shdrs;
 
-    bool littleEndian;
-
     bool changed = false;
 
+    /* Whether rewriteSections() has to lay out the file even if no
+       section was replaced, e.g. because a program header was added. */
+    bool forceRewrite = false;
+
     bool isExecutable = false;
 
     using SectionName = std::string;
-    using ReplacedSections = std::map<SectionName, std::string>;
+    using ReplacedSections = std::map<SectionName, std::string, std::less<>>;
 
     ReplacedSections replacedSections;
 
     std::string sectionNames; /* content of the .shstrtab section */
 
+    /* Index of the first section with each name, pointing into
+       sectionNames.  Rebuilt by indexSections() whenever the section
+       headers or their names change. */
+    std::unordered_map<std::string_view, unsigned int> sectionIndices;
+
     /* Align on 4 or 8 bytes boundaries on 32- or 64-bit platforms
        respectively. */
     static constexpr size_t sectionAlignment = sizeof(Elf_Off);
 
-    std::vector<SectionName> sectionsByOldIndex;
+    /* The current index of each section, by the index that the symbol
+       tables still refer to it by; 0 once it is gone. */
+    std::vector<unsigned int> sectionsByOldIndex;
+    /* The addresses of the sections by those indices, as the STT_SECTION
+       symbols have them. */
+    std::vector<Elf_Addr> sectionAddrsByOldIndex;
+
+    /* How often each dynamic symbol is looked up, if known, so that the
+       hash tables can put the busiest symbols first. */
+    const std::unordered_map<std::string_view, uint64_t> * symbolProfile = nullptr;
+
+    /* The strings of a string table, for addString(): their offsets by
+       hash, and again in the order of the reversed strings, so that a
+       string can also be found as the tail of a longer one.  Covers the
+       first 'size' bytes of the table. */
+    struct StrTabIndex
+    {
+        std::unordered_multimap<size_t, size_t> byHash;
+        std::vector<size_t> byTail;
+        size_t size = 0;
+    };
+    std::map<SectionName, StrTabIndex, std::less<>> strTabIndices;
+
+    /* How many bytes the section header table may occupy at e_shoff
+       without overwriting anything else. */
+    size_t shdrTableRoom = 0;
+
+    /* Where placeInFreeSpace() found room for a replaced section. */
+    struct Placement
+    {
+        Elf_Off offset;
+        Elf_Addr addr;
+    };
+    using Placements = std::map<SectionName, Placement, std::less<>>;
+
+    /* Everything written to fileContents since it was read. */
+    DirtyRanges dirty;
 
 public:
     explicit ElfFile(FileContents fileContents);
@@ -72,8 +241,27 @@ public:
         return changed;
     }
 
+    [[nodiscard]] const DirtyRanges & dirtyRanges() const noexcept
+    {
+        return dirty;
+    }
+
 private:
 
+    void markDirty(size_t offset, size_t size)
+    {
+        dirty.add(offset, size);
+    }
+
+    void markDirty(const Elf_Shdr & shdr)
+    {
+        if (rdi(shdr.sh_type) != SHT_NOBITS)
+            markDirty(rdi(shdr.sh_offset), rdi(shdr.sh_size));
+    }
+
+    /* Grow fileContents, keeping track of the new bytes. */
+    void growFile(size_t newSize);
+
     struct CompPhdr
     {
         const ElfFile * elfFile;
@@ -90,45 +278,57 @@ private:
 
     void sortPhdrs();
 
-    struct CompShdr
-    {
-        const ElfFile * elfFile;
-        bool operator ()(const Elf_Shdr & x, const Elf_Shdr & y) const noexcept
-        {
-            return elfFile->rdi(x.sh_offset) < elfFile->rdi(y.sh_offset);
-        }
-    };
-
     [[nodiscard]] unsigned int getPageSize() const noexcept;
 
     void sortShdrs();
 
+    void indexSections();
+
     void shiftFile(unsigned int extraPages, size_t sizeOffset, size_t extraBytes);
 
-    [[nodiscard]] std::string getSectionName(const Elf_Shdr & shdr) const;
+    [[nodiscard]] std::string_view getSectionName(const Elf_Shdr & shdr) const;
 
-    const Elf_Shdr & findSectionHeader(const SectionName & sectionName) const;
+    const Elf_Shdr & findSectionHeader(std::string_view sectionName) const;
 
-    [[nodiscard]] std::optional<std::reference_wrapper<const Elf_Shdr>> tryFindSectionHeader(const SectionName & sectionName) const;
+    [[nodiscard]] std::optional<std::reference_wrapper<const Elf_Shdr>> tryFindSectionHeader(std::string_view sectionName) const;
 
     template<class T> span<T> getSectionSpan(const Elf_Shdr & shdr) const;
     template<class T> span<T> getSectionSpan(const SectionName & sectionName);
     template<class T> span<T> tryGetSectionSpan(const SectionName & sectionName);
     span<char> getStrTab(const Elf_Shdr & shdr) const;
 
-    [[nodiscard]] unsigned int getSectionIndex(const SectionName & sectionName) const;
+    /* Like the above, but seeing edits not yet laid out by rewriteSections(). */
+    template<class T> span<T> getCurrentSectionSpan(const Elf_Shdr & shdr);
+    span<char> getCurrentStrTab(const Elf_Shdr & shdr);
+    [[nodiscard]] size_t getCurrentSectionSize(const Elf_Shdr & shdr) const;
+
+    [[nodiscard]] unsigned int getSectionIndex(std::string_view sectionName) const;
 
     std::string & replaceSection(const SectionName & sectionName,
         unsigned int size);
 
-    [[nodiscard]] bool hasReplacedSection(const SectionName & sectionName) const;
-    [[nodiscard]] bool canReplaceSection(const SectionName & sectionName) const;
+    /* The offset of 's' in the string table 'sectionName', which is
+       appended to it unless it is there already, as a string of its
+       own or as the tail of another one. */
+    size_t addString(const SectionName & sectionName, std::string_view s);
+
+    /* The same for a number of strings at once, which only appends to
+       the table once. */
+    std::vector<size_t> addStrings(const SectionName & sectionName, const std::vector<std::string_view> & strs);
+
+    [[nodiscard]] bool hasReplacedSection(std::string_view sectionName) const;
+    [[nodiscard]] bool canReplaceSection(std::string_view sectionName) const;
 
     void writeReplacedSections(Elf_Off & curOff,
-        Elf_Addr startAddr, Elf_Off startOffset);
+        Elf_Addr startAddr, Elf_Off startOffset,
+        const Placements & placements = {});
+
+    Placements placeInFreeSpace(Elf_Off reservedEnd);
 
     void rewriteHeaders(Elf_Addr phdrAddress);
 
+    void remapSymbolSections();
+
     void rewriteSectionsLibrary();
 
     void rewriteSectionsExecutable();
@@ -163,6 +363,7 @@ public:
     bool compactDynamic(Elf_Shdr & shdrDynamic, Drop && drop);
 
     unsigned int dynNullIndex(const std::string & newDynamic) const;
+    void insertDynEntries(const Elf_Dyn * entries, size_t count);
 
     void addNeeded(const std::set<std::string> & libs);
 
@@ -170,7 +371,7 @@ public:
 
     void replaceNeeded(const std::map<std::string, std::string> & libs);
 
-    void printNeededLibs() const;
+    void printNeededLibs();
 
     void noDefaultLib();
 
@@ -178,10 +379,26 @@ public:
 
     void buildResolutionCache();
 
-    void renameDynamicSymbols(const std::unordered_map<std::string_view, std::string>&);
+    void renameDynamicSymbols(const SymbolRenameMap & remap);
+
+    void orderSymbolsByProfile(const std::unordered_map<std::string_view, uint64_t> & profile);
 
     void clearSymbolVersions(const std::set<std::string> & syms);
 
+    /* Sets the size of a section that stays where it is, both in shdrs
+       and in the section header table of the file. */
+    void setSectionSize(unsigned int index, size_t size);
+
+    void compactDynStr();
+
+    void optimizeGnuHash();
+
+    void addGnuHashTable();
+
+    void layOutGnuHashTable(uint32_t symndx);
+
+    void printHashStats(bool json, const std::string & fileName);
+
     enum class ExecstackMode { print, set, clear };
 
     void modifyExecstack(ExecstackMode op);
@@ -205,6 +422,11 @@ private:
     };
     HashTable parseHashTable(span<char> gh);
 
+    template<class Hash, class Store>
+    void hashSymbolNames(span<char> strTab, span<Elf_Sym> syms, Hash && hash, Store && store);
+
+    std::vector<uint32_t> hotSymbols(span<char> strTab, span<Elf_Sym> syms) const;
+
     void rebuildGnuHashTable(span<char> strTab, span<Elf_Sym> dynsyms);
     void rebuildHashTable(span<char> strTab, span<Elf_Sym> dynsyms);
 
@@ -294,8 +516,8 @@ private:
     }
 
     /* Convert an integer in big or little endian representation (as
-       specified by the ELF header) to this platform's integer
-       representation. */
+       specified by the ELF header, and fixed by LittleEndian) to this
+       platform's integer representation. */
     template<class I>
     constexpr I rdi(I i) const noexcept;
 
@@ -0,0 +1,24 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename "$0" .sh)
+READELF=${READELF:-readelf}
+
+rm -rf "${SCRATCH}"
+mkdir -p "${SCRATCH}"
+
+# A library with only a SysV .hash table gets a .gnu.hash one as well.
+cp libmany-syms-sysv.so "${SCRATCH}/libmany-syms.so"
+cp many-syms-main "${SCRATCH}/"
+
+if ${READELF} -S "${SCRATCH}/libmany-syms.so" | grep -q "\.gnu\.hash"; then
+    echo "library already has a .gnu.hash section"
+    exit 1
+fi
+
+../src/patchelf --optimize-gnu-hash "${SCRATCH}/libmany-syms.so"
+
+${READELF} -S "${SCRATCH}/libmany-syms.so" | grep -q "\.gnu\.hash"
+${READELF} -d "${SCRATCH}/libmany-syms.so" | grep -q "(GNU_HASH)"
+${READELF} -d "${SCRATCH}/libmany-syms.so" | grep -q "(HASH)"
+
+# The loader prefers the new table; every symbol must still be found.
+env LD_BIND_NOW=1 LD_LIBRARY_PATH="${SCRATCH}" "${SCRATCH}/many-syms-main"
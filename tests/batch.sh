@@ -0,0 +1,105 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename "$0" .sh)
+
+rm -rf "${SCRATCH}"
+mkdir -p "${SCRATCH}/batch" "${SCRATCH}/single"
+
+for f in libfoo.so libbar.so simple main; do
+    cp "$f" "${SCRATCH}/batch/"
+    cp "$f" "${SCRATCH}/single/"
+done
+
+tab=$(printf '\t')
+
+# Each file gets its own operations; fields are separated by tabs so that
+# arguments can contain spaces.
+cat > "${SCRATCH}/manifest" <<EOF2
+# file${tab}operations...
+${SCRATCH}/batch/libfoo.so${tab}--set-rpath${tab}/opt/foo lib${tab}--add-needed${tab}libextra.so
+
+${SCRATCH}/batch/libbar.so${tab}--remove-rpath
+${SCRATCH}/batch/simple${tab}--set-interpreter${tab}/lib/ld-other.so${tab}--add-rpath${tab}/opt/a:/opt/b
+${SCRATCH}/batch/main${tab}--output${tab}${SCRATCH}/batch/main.out${tab}--set-soname${tab}libmain.so
+EOF2
+
+../src/patchelf --set-rpath "/opt/foo lib" --add-needed libextra.so "${SCRATCH}/single/libfoo.so"
+../src/patchelf --remove-rpath "${SCRATCH}/single/libbar.so"
+../src/patchelf --set-interpreter /lib/ld-other.so --add-rpath /opt/a:/opt/b "${SCRATCH}/single/simple"
+../src/patchelf --output "${SCRATCH}/single/main.out" --set-soname libmain.so "${SCRATCH}/single/main"
+
+check() {
+    ../src/patchelf --batch "${SCRATCH}/manifest" "$@"
+    for f in libfoo.so libbar.so simple main main.out; do
+        if ! cmp "${SCRATCH}/single/$f" "${SCRATCH}/batch/$f"; then
+            echo "$f differs when patched with --batch $*"
+            exit 1
+        fi
+    done
+}
+
+check
+for f in libfoo.so libbar.so simple main; do
+    cp "$f" "${SCRATCH}/batch/"
+done
+rm "${SCRATCH}/batch/main.out"
+check --jobs 3
+
+# Operations on the command line also apply to each manifest line, and
+# queries are answered in manifest order, after the files on the command line.
+printf '%s\t--print-rpath\n%s\t--print-needed\n' "${SCRATCH}/batch/simple" "${SCRATCH}/batch/libfoo.so" > "${SCRATCH}/query"
+../src/patchelf --print-soname "${SCRATCH}/batch/main.out" --batch "${SCRATCH}/query" > "${SCRATCH}/query.out"
+{
+    echo libmain.so
+    ../src/patchelf --print-soname --print-rpath "${SCRATCH}/batch/simple"
+    ../src/patchelf --print-soname --print-needed "${SCRATCH}/batch/libfoo.so"
+} > "${SCRATCH}/query.expected"
+if ! cmp "${SCRATCH}/query.expected" "${SCRATCH}/query.out"; then
+    echo "unexpected output from --batch queries"
+    exit 1
+fi
+
+cp libbar.so "${SCRATCH}/batch/libbar-defaults.so"
+cp libbar.so "${SCRATCH}/single/libbar-defaults.so"
+printf '%s\t--set-soname\tlibdefaults.so\n' "${SCRATCH}/batch/libbar-defaults.so" > "${SCRATCH}/defaults"
+../src/patchelf --add-rpath /opt/defaults --batch "${SCRATCH}/defaults"
+../src/patchelf --add-rpath /opt/defaults --set-soname libdefaults.so "${SCRATCH}/single/libbar-defaults.so"
+if ! cmp "${SCRATCH}/single/libbar-defaults.so" "${SCRATCH}/batch/libbar-defaults.so"; then
+    echo "command-line operations were not applied to the manifest"
+    exit 1
+fi
+
+# --output names a single file, which cannot be shared with a manifest.
+if ../src/patchelf --output "${SCRATCH}/x" --batch "${SCRATCH}/defaults" 2> "${SCRATCH}/output.err"; then
+    echo "--output was accepted with --batch"
+    exit 1
+fi
+grep -q "only allowed with single input file" "${SCRATCH}/output.err"
+
+# A file listed on several lines gets their operations in turn, even with
+# --jobs.
+for mode in serial parallel; do
+    cp libbar.so "${SCRATCH}/libbar-$mode.so"
+    {
+        printf '%s\t--set-rpath\t/opt/first/rather/long/path\n' "${SCRATCH}/libbar-$mode.so"
+        printf '%s\t--add-needed\tlibextra1.so\n' "${SCRATCH}/libbar-$mode.so"
+        printf '%s\t--set-soname\tlibbar-renamed.so\n' "${SCRATCH}/libbar-$mode.so"
+        printf '%s\t--add-needed\tlibextra2.so\t--add-rpath\t/opt/second\n' "${SCRATCH}/libbar-$mode.so"
+    } > "${SCRATCH}/dup-$mode"
+done
+../src/patchelf --batch "${SCRATCH}/dup-serial"
+../src/patchelf --jobs 4 --batch "${SCRATCH}/dup-parallel"
+if ! cmp "${SCRATCH}/libbar-serial.so" "${SCRATCH}/libbar-parallel.so"; then
+    echo "a file listed twice differs when patched with --jobs"
+    exit 1
+fi
+
+# Mistakes in the manifest are reported with their line before anything
+# is patched.
+cp "${SCRATCH}/batch/libbar.so" "${SCRATCH}/libbar.so.before"
+printf '%s\t--set-rpath\t/x\n%s\t--frobnicate\n' "${SCRATCH}/batch/libbar.so" "${SCRATCH}/batch/simple" > "${SCRATCH}/bad"
+if ../src/patchelf --batch "${SCRATCH}/bad" 2> "${SCRATCH}/bad.err"; then
+    echo "invalid manifest was accepted"
+    exit 1
+fi
+grep -q "bad:2: unknown operation '--frobnicate'" "${SCRATCH}/bad.err"
+cmp "${SCRATCH}/libbar.so.before" "${SCRATCH}/batch/libbar.so"
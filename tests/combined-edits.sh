@@ -0,0 +1,53 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename "$0" .sh)
+
+READELF=${READELF:-readelf}
+
+rm -rf "${SCRATCH}"
+mkdir -p "${SCRATCH}/libsA" "${SCRATCH}/libsB"
+
+cp main "${SCRATCH}/"
+cp libfoo.so "${SCRATCH}/libsA/"
+cp libbar.so "${SCRATCH}/libsB/"
+cp libfoo.so "${SCRATCH}/libfoo-single.so"
+
+loads() {
+    ${READELF} -lW "$1" | grep -c LOAD
+}
+
+# All edits given together are laid out in one pass, so they add no more
+# segments than a single edit does.
+../src/patchelf --set-rpath "$(pwd)/${SCRATCH}/libsA/././././././././././././././././." "${SCRATCH}/libfoo-single.so"
+../src/patchelf --set-soname libfoo-with-a-longer-name.so \
+    --set-rpath "$(pwd)/${SCRATCH}/libsB/././././././././././././././././." \
+    --add-needed libbar.so --add-debug-tag --no-default-lib "${SCRATCH}/libsA/libfoo.so"
+
+if [ "$(loads "${SCRATCH}/libsA/libfoo.so")" -ne "$(loads "${SCRATCH}/libfoo-single.so")" ]; then
+    echo "combined edits added more segments than a single one"
+    exit 1
+fi
+
+test "$(../src/patchelf --print-soname "${SCRATCH}/libsA/libfoo.so")" = libfoo-with-a-longer-name.so
+../src/patchelf --print-needed "${SCRATCH}/libsA/libfoo.so" | grep -q '^libbar.so$'
+${READELF} -d "${SCRATCH}/libsA/libfoo.so" | grep -q '(DEBUG)'
+${READELF} -d "${SCRATCH}/libsA/libfoo.so" | grep -q 'NODEFLIB'
+
+# Later edits see what earlier ones did to the same sections.
+cp "${SCRATCH}/libsA/libfoo.so" "${SCRATCH}/libsA/libfoo-renamed.so"
+../src/patchelf --add-rpath "$(pwd)/${SCRATCH}/libsA" --replace-needed libfoo.so libfoo-renamed.so \
+    --add-debug-tag "${SCRATCH}/main"
+test "$(../src/patchelf --print-rpath "${SCRATCH}/main")" = "$(pwd)/${SCRATCH}/libsA"
+../src/patchelf --print-needed "${SCRATCH}/main" | grep -q '^libfoo-renamed.so$'
+
+if test "$(uname)" = FreeBSD; then
+    LD_LIBRARY_PATH="$(pwd)/${SCRATCH}/libsB"
+    export LD_LIBRARY_PATH
+fi
+
+exitCode=0
+(cd "${SCRATCH}" && ./main) || exitCode=$?
+
+if test "$exitCode" != 46; then
+    echo "bad exit code!"
+    exit 1
+fi
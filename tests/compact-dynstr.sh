@@ -0,0 +1,68 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename "$0" .sh)
+READELF=${READELF:-readelf}
+
+rm -rf "${SCRATCH}"
+mkdir -p "${SCRATCH}"
+mkdir -p "${SCRATCH}/libsA"
+mkdir -p "${SCRATCH}/libsB"
+
+cp main "${SCRATCH}/"
+cp libfoo.so "${SCRATCH}/libsA/"
+cp libbar.so "${SCRATCH}/libsB/"
+
+dynstr_size() {
+    ${READELF} -W -S "$1" | sed -n 's/.*\] \.dynstr *STRTAB *[0-9a-f]* [0-9a-f]* \([0-9a-f]*\).*/\1/p'
+}
+
+strings_of() {
+    ${READELF} -W -d "$1" | grep -E "NEEDED|SONAME|RPATH|RUNPATH"
+    ${READELF} -W -V "$1" | grep -E "Name:|Version:|File:" | sed 's/^ *0x[0-9a-f]*://'
+    ${READELF} -W --dyn-syms "$1" | awk 'NR > 3 { print $8 }'
+}
+
+# Each of these leaves the previous rpath behind in .dynstr.
+for i in 1 2 3 4 5; do
+    ../src/patchelf --set-rpath "/some/long/path/number/$i/that/is/not/used" "${SCRATCH}/main"
+    ../src/patchelf --set-rpath "/another/long/path/number/$i" "${SCRATCH}/libsA/libfoo.so"
+done
+../src/patchelf --set-rpath "$(pwd)/${SCRATCH}/libsA" "${SCRATCH}/main"
+../src/patchelf --set-rpath "$(pwd)/${SCRATCH}/libsB" "${SCRATCH}/libsA/libfoo.so"
+../src/patchelf --replace-needed libbar.so libbar.so "${SCRATCH}/libsA/libfoo.so"
+
+for file in "${SCRATCH}/main" "${SCRATCH}/libsA/libfoo.so"; do
+    strings_of "${file}" > "${file}.before"
+    size_before=$(dynstr_size "${file}")
+
+    ../src/patchelf --compact-dynstr "${file}"
+
+    strings_of "${file}" > "${file}.after"
+    size_after=$(dynstr_size "${file}")
+    echo "${file}: .dynstr 0x${size_before} -> 0x${size_after}"
+
+    if ! diff "${file}.before" "${file}.after"; then
+        echo "compaction changed the strings of ${file}"
+        exit 1
+    fi
+    if [ $((0x${size_after})) -ge $((0x${size_before})) ]; then
+        echo "compaction did not shrink .dynstr of ${file}"
+        exit 1
+    fi
+    if grep -q "/number/" "${file}"; then
+        echo "old rpaths are still in ${file}"
+        exit 1
+    fi
+
+    # There is nothing left to drop the second time round.
+    cp "${file}" "${file}.once"
+    ../src/patchelf --compact-dynstr "${file}"
+    cmp "${file}" "${file}.once"
+done
+
+exitCode=0
+(cd "${SCRATCH}" && ./main) || exitCode=$?
+
+if test "$exitCode" != 46; then
+    echo "bad exit code!"
+    exit 1
+fi
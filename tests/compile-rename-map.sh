@@ -0,0 +1,70 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename "$0" .sh)
+
+rm -rf "${SCRATCH}"
+mkdir -p "${SCRATCH}"
+
+cp libmany-syms.so many-syms-main "${SCRATCH}/"
+chmod +w "${SCRATCH}"/*
+
+i=1
+while [ $i -le 2000 ]; do echo "f$i f${i}_renamed"; i=$((i + 1)); done > "${SCRATCH}/map"
+
+# A compiled map renames exactly like the text map it was compiled from.
+../src/patchelf --compile-rename-map "${SCRATCH}/map" "${SCRATCH}/map.bin"
+# It is a data file, not a program.
+if [ -x "${SCRATCH}/map.bin" ]; then
+    echo "the compiled map is executable"
+    exit 1
+fi
+../src/patchelf --rename-dynamic-symbols "${SCRATCH}/map" --output "${SCRATCH}/libtext.so" libmany-syms.so
+../src/patchelf --rename-dynamic-symbols "${SCRATCH}/map.bin" --output "${SCRATCH}/libbin.so" libmany-syms.so
+cmp "${SCRATCH}/libtext.so" "${SCRATCH}/libbin.so"
+nm -D "${SCRATCH}/libbin.so" | grep -q " f1234_renamed$"
+if nm -D "${SCRATCH}/libbin.so" | grep -q " f1234$"; then
+    echo "f1234 was not renamed"
+    exit 1
+fi
+
+# Renaming back restores the symbols the program looks for.
+awk '{ print $2, $1 }' "${SCRATCH}/map" > "${SCRATCH}/rmap"
+../src/patchelf --compile-rename-map "${SCRATCH}/rmap" "${SCRATCH}/rmap.bin"
+../src/patchelf --rename-dynamic-symbols "${SCRATCH}/rmap.bin" "${SCRATCH}/libbin.so"
+cp "${SCRATCH}/libbin.so" "${SCRATCH}/libmany-syms.so"
+env LD_BIND_NOW=1 LD_LIBRARY_PATH="${SCRATCH}" "${SCRATCH}/many-syms-main"
+
+# A map given for several files is read once.
+cp libmany-syms.so "${SCRATCH}/liba.so"
+cp libmany-syms.so "${SCRATCH}/libb.so"
+tab=$(printf '\t')
+cat > "${SCRATCH}/manifest" <<EOF2
+${SCRATCH}/liba.so${tab}--rename-dynamic-symbols${tab}${SCRATCH}/map
+${SCRATCH}/libb.so${tab}--rename-dynamic-symbols${tab}${SCRATCH}/map
+EOF2
+../src/patchelf --debug --batch "${SCRATCH}/manifest" 2> "${SCRATCH}/log"
+test "$(grep -c "read 2000 names to rename" "${SCRATCH}/log")" -eq 1
+cmp "${SCRATCH}/liba.so" "${SCRATCH}/libtext.so"
+cmp "${SCRATCH}/libb.so" "${SCRATCH}/libtext.so"
+
+# A truncated compiled map is rejected rather than read past its end.
+head -c 100 "${SCRATCH}/map.bin" > "${SCRATCH}/bad.bin"
+if ../src/patchelf --rename-dynamic-symbols "${SCRATCH}/bad.bin" "${SCRATCH}/liba.so" 2> "${SCRATCH}/log"; then
+    echo "a truncated compiled map should be rejected"
+    exit 1
+fi
+grep -q "compiled rename map is corrupt" "${SCRATCH}/log"
+
+# Text maps are still checked when they are compiled.
+printf 'f1 g1\nf1 g2\n' > "${SCRATCH}/dupmap"
+if ../src/patchelf --compile-rename-map "${SCRATCH}/dupmap" "${SCRATCH}/dup.bin" 2> "${SCRATCH}/log"; then
+    echo "a map with duplicate names should be rejected"
+    exit 1
+fi
+grep -q "appears twice" "${SCRATCH}/log"
+
+# A missing map is reported as such.
+if ../src/patchelf --rename-dynamic-symbols "${SCRATCH}/nomap" "${SCRATCH}/liba.so" 2> "${SCRATCH}/log"; then
+    echo "a missing map should be rejected"
+    exit 1
+fi
+grep -q "Cannot open map file ${SCRATCH}/nomap" "${SCRATCH}/log"
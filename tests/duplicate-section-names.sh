@@ -0,0 +1,27 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename "$0" .sh)
+OBJCOPY=${OBJCOPY:-objcopy}
+READELF=${READELF:-readelf}
+
+rm -rf "${SCRATCH}"
+mkdir -p "${SCRATCH}"
+
+cp main-no-pie "${SCRATCH}/"
+
+# Give another section the name of the string table that .symtab links to.
+${OBJCOPY} --rename-section .comment=.strtab "${SCRATCH}/main-no-pie"
+
+symtabLink() {
+    ${READELF} -SW "$1" | awk '$0 ~ /\] \.symtab / { print $(NF-2) }'
+}
+
+oldLink=$(symtabLink "${SCRATCH}/main-no-pie")
+
+# This moves the sections around, so their links have to be remapped.
+../src/patchelf --set-interpreter /lib/a/rather/long/path/to/a/dynamic/loader/that/does/not/fit/ld.so "${SCRATCH}/main-no-pie"
+
+newLink=$(symtabLink "${SCRATCH}/main-no-pie")
+if [ "$oldLink" != "$newLink" ]; then
+    echo ".symtab links to section $newLink instead of $oldLink"
+    exit 1
+fi
@@ -0,0 +1,35 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename "$0" .sh)
+READELF=${READELF:-readelf}
+
+rm -rf "${SCRATCH}"
+mkdir -p "${SCRATCH}"
+
+cp libfoo.so "${SCRATCH}/"
+
+dynstr_size() {
+    echo $((0x$(${READELF} -W -S "$1" | sed -n 's/.*\] \.dynstr *STRTAB *[0-9a-f]* [0-9a-f]* \([0-9a-f]*\).*/\1/p')))
+}
+
+lib="${SCRATCH}/libfoo.so"
+size=$(dynstr_size "${lib}")
+
+# Strings already in .dynstr are reused, also as the tail of another one.
+../src/patchelf --set-soname libbar.so "${lib}"
+../src/patchelf --add-needed bar.so "${lib}"
+if [ "$(dynstr_size "${lib}")" -ne "${size}" ]; then
+    echo "existing strings were added to .dynstr again"
+    exit 1
+fi
+../src/patchelf --print-soname "${lib}" | grep -qx libbar.so
+../src/patchelf --print-needed "${lib}" | grep -qx bar.so
+../src/patchelf --print-needed "${lib}" | grep -qx libbar.so
+
+# A new string is added once, however often it is used.
+../src/patchelf --add-needed libnew.so --set-soname libnew.so --replace-needed bar.so libnew.so "${lib}"
+if [ "$(dynstr_size "${lib}")" -ne $((size + 10)) ]; then
+    echo "libnew.so was not added to .dynstr exactly once"
+    exit 1
+fi
+../src/patchelf --print-soname "${lib}" | grep -qx libnew.so
+test "$(../src/patchelf --print-needed "${lib}" | grep -cx libnew.so)" = 2
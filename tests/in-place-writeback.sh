@@ -0,0 +1,65 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename "$0" .sh)
+
+rm -rf "${SCRATCH}"
+mkdir -p "${SCRATCH}"
+
+cp libfoo.so "${SCRATCH}/"
+cp simple "${SCRATCH}/"
+cp main-no-pie "${SCRATCH}/"
+
+# Start from a long rpath so that later edits fit in the existing space.
+../src/patchelf --set-rpath /a/very/long/rpath/that/leaves/plenty/of/room "${SCRATCH}/libfoo.so"
+
+# Each edit is applied in place and with --output, and both results are
+# compared with a full rewrite of the file.  Writing to a pipe forces that
+# rewrite, since a pipe can neither be cloned nor patched in place.
+check() {
+    file="$1"
+    shift
+    cp "${SCRATCH}/${file}" "${SCRATCH}/${file}.orig"
+    cp "${SCRATCH}/${file}" "${SCRATCH}/${file}.inplace"
+    ../src/patchelf "$@" --output /dev/stdout "${SCRATCH}/${file}.orig" | cat > "${SCRATCH}/${file}.ref"
+    ../src/patchelf "$@" --output "${SCRATCH}/${file}.copy" "${SCRATCH}/${file}.orig"
+    ../src/patchelf "$@" "${SCRATCH}/${file}.inplace"
+    if ! cmp "${SCRATCH}/${file}.ref" "${SCRATCH}/${file}.inplace"; then
+        echo "in-place result of '$*' differs from a full rewrite"
+        exit 1
+    fi
+    if ! cmp "${SCRATCH}/${file}.ref" "${SCRATCH}/${file}.copy"; then
+        echo "--output result of '$*' differs from a full rewrite"
+        exit 1
+    fi
+}
+
+check libfoo.so --set-rpath /short
+check libfoo.so --remove-rpath
+check libfoo.so --shrink-rpath
+check libfoo.so --set-soname libf.so
+check libfoo.so --set-execstack
+check libfoo.so --clear-symbol-version puts
+check libfoo.so --set-os-abi freebsd
+check libfoo.so --replace-needed libbar.so libb.so
+check simple --set-rpath /a/rather/long/rpath/that/grows/the/file/quite/a/bit
+check simple --set-interpreter /lib/ld-missing.so
+# Non-PIE executables make room by moving the rest of the file back.
+check main-no-pie --set-interpreter /lib/a/rather/long/path/to/a/dynamic/loader/that/does/not/fit/ld.so
+check main-no-pie --add-needed libextra.so
+# Large pages mean lots of zero padding, which is written as holes.
+check libfoo.so --page-size 65536 --set-rpath /a/rpath/that/does/not/fit/into/the/old/one/at/all/xxxxxxxxxxxxxxxx
+check main-no-pie --page-size 65536 --set-interpreter /lib/another/rather/long/path/to/a/dynamic/loader/ld.so
+
+# A same-size edit like this one should not rewrite the whole file.
+cp "${SCRATCH}/libfoo.so" "${SCRATCH}/libfoo.so.inplace"
+../src/patchelf --set-rpath /short "${SCRATCH}/libfoo.so.inplace" 2> "${SCRATCH}/log"
+grep -q "in place" "${SCRATCH}/log"
+
+# An output file with a second name is rewritten rather than replaced, so
+# both names keep referring to the patched file.
+cp "${SCRATCH}/libfoo.so" "${SCRATCH}/linked"
+ln "${SCRATCH}/linked" "${SCRATCH}/linked.alias"
+../src/patchelf --set-soname libl.so --output "${SCRATCH}/linked" "${SCRATCH}/libfoo.so"
+if [ "$(../src/patchelf --print-soname "${SCRATCH}/linked.alias")" != libl.so ]; then
+    echo "--output broke the hard link to its output file"
+    exit 1
+fi
@@ -130,7 +130,7 @@ invalid_verneed_file_MSG='string table index out of bounds'
 # shellcheck disable=SC2034
 invalid_verneed_file_ARGS='--replace-needed libc.so.6 libx.so'
 # shellcheck disable=SC2034
-invalid_dynamic_noterm_MSG='setSubstr: write extends past end of section'
+invalid_dynamic_noterm_MSG='.dynamic section has no DT_NULL terminator'
 # shellcheck disable=SC2034
 invalid_dynamic_noterm_ARGS='--add-debug-tag'
 # shellcheck disable=SC2034
@@ -0,0 +1,61 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename "$0" .sh)
+READELF=${READELF:-readelf}
+
+rm -rf "${SCRATCH}"
+mkdir -p "${SCRATCH}"
+
+cp libmany-syms.so many-syms-main "${SCRATCH}/"
+chmod +w "${SCRATCH}"/*
+
+# Small enough to be rebuilt where it is, or large enough to be moved:
+# either way all symbols must still be found.
+../src/patchelf --optimize-gnu-hash "${SCRATCH}/libmany-syms.so" 2> "${SCRATCH}/log"
+grep -q "^.gnu.hash: .* buckets" "${SCRATCH}/log"
+env LD_BIND_NOW=1 LD_LIBRARY_PATH="${SCRATCH}" "${SCRATCH}/many-syms-main"
+
+# The parameters only depend on the symbols, so doing it again changes
+# nothing.
+../src/patchelf --optimize-gnu-hash --output "${SCRATCH}/libagain.so" "${SCRATCH}/libmany-syms.so"
+cmp "${SCRATCH}/libmany-syms.so" "${SCRATCH}/libagain.so"
+
+# The table is tuned to the renamed symbols.
+printf 'f1 g1\nf2 g2\n' > "${SCRATCH}/map"
+../src/patchelf --rename-dynamic-symbols "${SCRATCH}/map" --optimize-gnu-hash --output "${SCRATCH}/librenamed.so" libmany-syms.so
+nm -D "${SCRATCH}/librenamed.so" | grep -q " g1$"
+printf 'g1 f1\ng2 f2\n' > "${SCRATCH}/map"
+../src/patchelf --rename-dynamic-symbols "${SCRATCH}/map" --optimize-gnu-hash "${SCRATCH}/librenamed.so"
+cp "${SCRATCH}/librenamed.so" "${SCRATCH}/libmany-syms.so"
+env LD_BIND_NOW=1 LD_LIBRARY_PATH="${SCRATCH}" "${SCRATCH}/many-syms-main"
+
+# With both tables, .hash has to follow the new symbol order. The loader
+# prefers .gnu.hash, so make it use .hash by turning the DT_GNU_HASH entry
+# into a DT_DEBUG one, which it ignores in a library.
+mkdir -p "${SCRATCH}/both"
+cp libmany-syms-both.so "${SCRATCH}/both/libmany-syms.so"
+chmod +w "${SCRATCH}/both/libmany-syms.so"
+../src/patchelf --optimize-gnu-hash "${SCRATCH}/both/libmany-syms.so"
+env LD_BIND_NOW=1 LD_LIBRARY_PATH="${SCRATCH}/both" "${SCRATCH}/many-syms-main"
+
+set -- $(${READELF} -SW "${SCRATCH}/both/libmany-syms.so" | sed -n 's/^.*\] \.dynamic  *//p')
+dynamic_off=$((0x$3))
+dyn_ent=$((0x$5))
+index=$(${READELF} -dW "${SCRATCH}/both/libmany-syms.so" | awk '/^ *0x/ { if ($2 == "(GNU_HASH)") print n; n++ }')
+if ${READELF} -h "${SCRATCH}/both/libmany-syms.so" | grep -q "big endian"; then
+    tag=$(printf '%*s\\025' $((dyn_ent / 2 - 1)) '' | sed 's/ /\\0/g')
+else
+    tag=$(printf '\\025%*s' $((dyn_ent / 2 - 1)) '' | sed 's/ /\\0/g')
+fi
+printf '%b' "$tag" | dd of="${SCRATCH}/both/libmany-syms.so" bs=1 seek=$((dynamic_off + index * dyn_ent)) conv=notrunc 2>/dev/null
+${READELF} -dW "${SCRATCH}/both/libmany-syms.so" | grep -q "(DEBUG)"
+env LD_BIND_NOW=1 LD_LIBRARY_PATH="${SCRATCH}/both" "${SCRATCH}/many-syms-main"
+
+# Relocations against .symtab, as kept by --emit-relocs, do not refer to
+# .dynsym and must stay as they are, the same on every run.
+../src/patchelf --optimize-gnu-hash --output "${SCRATCH}/main1" main-emit-relocs
+../src/patchelf --optimize-gnu-hash --output "${SCRATCH}/main2" main-emit-relocs
+cmp "${SCRATCH}/main1" "${SCRATCH}/main2"
+${READELF} -rW main-emit-relocs | sed -n '/.rela.text/,/^$/p' > "${SCRATCH}/rela.orig"
+${READELF} -rW "${SCRATCH}/main1" | sed -n '/.rela.text/,/^$/p' > "${SCRATCH}/rela.new"
+test -s "${SCRATCH}/rela.orig"
+diff "${SCRATCH}/rela.orig" "${SCRATCH}/rela.new"
@@ -37,3 +37,23 @@ if test "$exitCode" != 46; then
     echo "bad exit code!"
     exit 1
 fi
+
+# --output must write through symlinks and leave no temporary files behind
+ln -s main4 "${SCRATCH}/main-link"
+cp "${SCRATCH}/main" "${SCRATCH}/main4"
+../src/patchelf --set-rpath "$(pwd)/${SCRATCH}/libsA:$(pwd)/${SCRATCH}/libsB" "${SCRATCH}/main" --output "${SCRATCH}/main-link"
+
+if ! test -L "${SCRATCH}/main-link"; then
+    echo "symlink was replaced!"
+    exit 1
+fi
+
+if ! ../src/patchelf --print-rpath "${SCRATCH}/main4" | grep -q libsB; then
+    echo "rpath not written through symlink!"
+    exit 1
+fi
+
+if ls "${SCRATCH}" | grep -q patchelf-; then
+    echo "temporary files left behind!"
+    exit 1
+fi
@@ -0,0 +1,60 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename "$0" .sh)
+
+rm -rf "${SCRATCH}"
+mkdir -p "${SCRATCH}/serial" "${SCRATCH}/parallel"
+
+files="libfoo.so libbar.so simple simple-pie main main-no-pie big-dynstr"
+for f in $files; do
+    cp "$f" "${SCRATCH}/serial/"
+    cp "$f" "${SCRATCH}/parallel/"
+done
+
+# Edits made with --jobs must match the ones made one file at a time.
+(cd "${SCRATCH}/serial" && ../../../../src/patchelf --add-rpath /opt/lib $files)
+(cd "${SCRATCH}/parallel" && ../../../../src/patchelf --jobs 4 --add-rpath /opt/lib $files)
+
+for f in $files; do
+    if ! cmp "${SCRATCH}/serial/$f" "${SCRATCH}/parallel/$f"; then
+        echo "$f differs when patched with --jobs"
+        exit 1
+    fi
+done
+
+# Printed output stays in the order the files were given.
+(cd "${SCRATCH}/serial" && ../../../../src/patchelf --print-rpath $files) > "${SCRATCH}/serial.out"
+(cd "${SCRATCH}/parallel" && ../../../../src/patchelf --jobs 4 --print-rpath $files) > "${SCRATCH}/parallel.out"
+
+if ! cmp "${SCRATCH}/serial.out" "${SCRATCH}/parallel.out"; then
+    echo "output of --jobs is not in input order"
+    exit 1
+fi
+
+# A failing file is still reported, and the run fails.
+touch "${SCRATCH}/parallel/empty"
+if ../src/patchelf --jobs 4 --print-rpath "${SCRATCH}/parallel/libfoo.so" "${SCRATCH}/parallel/empty" > "${SCRATCH}/fail.out" 2> "${SCRATCH}/fail.err"; then
+    echo "patchelf did not fail on an invalid file"
+    exit 1
+fi
+grep -q "/opt/lib" "${SCRATCH}/fail.out"
+grep -q "patchelf:" "${SCRATCH}/fail.err"
+
+# A file named more than once, here also through a hard link and a
+# directory, is patched once per name, one after the other, just as
+# without --jobs.
+for mode in serial parallel; do
+    mkdir -p "${SCRATCH}/$mode/dup"
+    cp big-dynstr libfoo.so "${SCRATCH}/$mode/dup/"
+    ln "${SCRATCH}/$mode/dup/libfoo.so" "${SCRATCH}/$mode/libfoo-link.so"
+done
+(cd "${SCRATCH}/serial" && ../../../../src/patchelf --add-rpath /opt/dup \
+    dup/big-dynstr dup/libfoo.so dup/big-dynstr libfoo-link.so --recursive dup)
+(cd "${SCRATCH}/parallel" && ../../../../src/patchelf --jobs 4 --add-rpath /opt/dup \
+    dup/big-dynstr dup/libfoo.so dup/big-dynstr libfoo-link.so --recursive dup)
+
+for f in big-dynstr libfoo.so; do
+    if ! cmp "${SCRATCH}/serial/dup/$f" "${SCRATCH}/parallel/dup/$f"; then
+        echo "$f differs when named several times with --jobs"
+        exit 1
+    fi
+done
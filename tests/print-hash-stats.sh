@@ -0,0 +1,37 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename "$0" .sh)
+
+rm -rf "${SCRATCH}"
+mkdir -p "${SCRATCH}"
+
+cp libmany-syms.so libmany-syms-sysv.so "${SCRATCH}/"
+chmod +w "${SCRATCH}"/*
+
+../src/patchelf --print-hash-stats text "${SCRATCH}/libmany-syms.so" > "${SCRATCH}/text"
+grep -q "^.gnu.hash: .* buckets, 2000 symbols$" "${SCRATCH}/text"
+grep -q "bloom false-positive rate" "${SCRATCH}/text"
+grep -q "probes per successful lookup" "${SCRATCH}/text"
+
+# One line per file, which names it.
+../src/patchelf --print-hash-stats json "${SCRATCH}/libmany-syms.so" "${SCRATCH}/libmany-syms-sysv.so" > "${SCRATCH}/json"
+test "$(wc -l < "${SCRATCH}/json")" -eq 2
+grep -q "^{\"file\": \"${SCRATCH}/libmany-syms.so\", \".gnu.hash\": {\"buckets\": " "${SCRATCH}/json"
+if grep "libmany-syms-sysv.so" "${SCRATCH}/json" | grep -q "gnu.hash"; then
+    echo "libmany-syms-sysv.so should only have a .hash table"
+    exit 1
+fi
+
+# After adding a .gnu.hash table, both are reported.
+../src/patchelf --optimize-gnu-hash "${SCRATCH}/libmany-syms-sysv.so"
+../src/patchelf --print-hash-stats json "${SCRATCH}/libmany-syms-sysv.so" | grep -q '".gnu.hash": .*".hash": '
+
+# Printing leaves the file alone.
+cp "${SCRATCH}/libmany-syms.so" "${SCRATCH}/orig.so"
+../src/patchelf --print-hash-stats text "${SCRATCH}/libmany-syms.so" > /dev/null
+cmp "${SCRATCH}/libmany-syms.so" "${SCRATCH}/orig.so"
+
+if ../src/patchelf --print-hash-stats xml "${SCRATCH}/libmany-syms.so" 2> "${SCRATCH}/log"; then
+    echo "an unknown format should be rejected"
+    exit 1
+fi
+grep -q "unknown hash stats format" "${SCRATCH}/log"
@@ -0,0 +1,54 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename "$0" .sh)
+
+rm -rf "${SCRATCH}"
+mkdir -p "${SCRATCH}/tree/lib/sub" "${SCRATCH}/tree/bin" "${SCRATCH}/outside"
+
+cp libfoo.so "${SCRATCH}/tree/lib/"
+cp simple "${SCRATCH}/tree/bin/"
+cp main "${SCRATCH}/tree/lib/sub/"
+cp simple "${SCRATCH}/outside/"
+echo "not an ELF file, but long enough to have looked like one" > "${SCRATCH}/tree/lib/README"
+printf '\177ELF' > "${SCRATCH}/tree/lib/short"
+ln "${SCRATCH}/tree/lib/libfoo.so" "${SCRATCH}/tree/lib/sub/libfoo-link.so"
+ln -s ../../outside/simple "${SCRATCH}/tree/bin/simple-link"
+ln -s ../outside "${SCRATCH}/tree/outside-link"
+
+check_rpath() {
+    rpath=$(../src/patchelf --print-rpath "$1")
+    if [ "$rpath" != "$2" ]; then
+        echo "wrong rpath '$rpath' on $1, expected '$2'"
+        exit 1
+    fi
+}
+
+# Every ELF file below the directory is patched exactly once: hard links
+# are not patched twice, symlinks are not followed, other files are left
+# alone.
+../src/patchelf --add-rpath /opt/lib --recursive "${SCRATCH}/tree/"
+
+check_rpath "${SCRATCH}/tree/lib/libfoo.so" /opt/lib
+check_rpath "${SCRATCH}/tree/lib/sub/main" /opt/lib
+check_rpath "${SCRATCH}/tree/bin/simple" /opt/lib
+check_rpath "${SCRATCH}/outside/simple" ""
+grep -q "not an ELF file" "${SCRATCH}/tree/lib/README"
+
+# Files are visited in sorted order, also when patched in parallel.
+../src/patchelf --print-rpath --recursive "${SCRATCH}/tree" > "${SCRATCH}/serial.out"
+../src/patchelf --jobs 4 --print-rpath --recursive "${SCRATCH}/tree" > "${SCRATCH}/parallel.out"
+if ! cmp "${SCRATCH}/serial.out" "${SCRATCH}/parallel.out"; then
+    echo "output of --recursive differs with --jobs"
+    exit 1
+fi
+test "$(wc -l < "${SCRATCH}/serial.out")" -eq 3
+
+../src/patchelf --jobs 4 --remove-rpath --recursive "${SCRATCH}/tree"
+check_rpath "${SCRATCH}/tree/lib/libfoo.so" ""
+check_rpath "${SCRATCH}/tree/lib/sub/main" ""
+check_rpath "${SCRATCH}/tree/bin/simple" ""
+
+# --output names a single file, which does not fit a directory walk.
+if ../src/patchelf --set-rpath /x --output "${SCRATCH}/out" --recursive "${SCRATCH}/tree" 2> /dev/null; then
+    echo "--output was accepted with --recursive"
+    exit 1
+fi
@@ -1,5 +1,6 @@
 #! /bin/sh -e
 SCRATCH=scratch/$(basename "$0" .sh)
+READELF=${READELF:-readelf}
 
 rm -rf "${SCRATCH}"
 mkdir -p "${SCRATCH}"
@@ -38,3 +39,19 @@ if ! ../src/patchelf --print-needed "${SCRATCH}/grow-needed" | grep -Fxq "totall
 	echo "library totallynew.so not found as NEEDED"
 	exit 1
 fi
+
+# Each replacement, after a new rpath, moves .dynstr again, including
+# for the .gnu.version_r entry of libc.so.6.
+long=$(printf 'x%.0s' $(seq 300))
+../src/patchelf --output "${SCRATCH}/libfoo-moved.so" --set-rpath "/${long}" \
+	--replace-needed libbar.so "libbar-${long}.so" --replace-needed libc.so.6 "libc-${long}.so.6" libfoo.so
+for lib in "libbar-${long}.so" "libc-${long}.so.6"; do
+	if ! ../src/patchelf --print-needed "${SCRATCH}/libfoo-moved.so" | grep -Fxq "${lib}"; then
+		echo "library ${lib} not found as NEEDED"
+		exit 1
+	fi
+done
+if ! ${READELF} -V "${SCRATCH}/libfoo-moved.so" | grep -Fq "File: libc-${long}.so.6"; then
+	echo ".gnu.version_r entry of libc.so.6 was not replaced"
+	exit 1
+fi
@@ -0,0 +1,43 @@
+#! /bin/sh -e
+
+SCRATCH=scratch/$(basename "$0" .sh)
+PATCHELF=$(readlink -f "../src/patchelf")
+READELF=${READELF:-readelf}
+
+rm -rf "${SCRATCH}"
+mkdir -p "${SCRATCH}"
+
+cp simple "${SCRATCH}/"
+cp libbar.so "${SCRATCH}/"
+
+cd "${SCRATCH}"
+
+${PATCHELF} --add-needed ./libbar.so simple
+
+# The first edit has to append the grown .dynstr to the file.
+${PATCHELF} --set-soname libbar-with-a-longer-name.so libbar.so
+load_segments=$(${READELF} -W -l libbar.so | grep -c LOAD)
+size=$(wc -c < libbar.so)
+
+# Later edits put it back into the space the previous copy occupied, so
+# neither another segment nor another page should be needed.
+for _ in $(seq 1 20)
+do
+    ${PATCHELF} --set-soname ./libbar.so libbar.so
+    ${PATCHELF} --set-soname libbar.so libbar.so
+    ./simple
+done
+
+load_segments_after=$(${READELF} -W -l libbar.so | grep -c LOAD)
+size_after=$(wc -c < libbar.so)
+echo "Segments: ${load_segments} -> ${load_segments_after}, size: ${size} -> ${size_after}"
+
+if [ "${load_segments_after}" -ne "${load_segments}" ]; then
+    echo "freed space was not reused, segments were added"
+    exit 1
+fi
+
+if [ "${size_after}" -gt $((size + 4096)) ]; then
+    echo "freed space was not reused, the file grew by more than a page"
+    exit 1
+fi
@@ -0,0 +1,48 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename "$0" .sh)
+READELF=${READELF:-readelf}
+
+rm -rf "${SCRATCH}"
+mkdir -p "${SCRATCH}"
+
+cp libmany-syms.so many-syms-main "${SCRATCH}/"
+chmod +w "${SCRATCH}"/*
+
+# The later a symbol, the more often it is looked up, which turns the
+# order within every chain around.
+i=1
+while [ $i -le 2000 ]; do echo "f$i $i"; i=$((i + 1)); done > "${SCRATCH}/profile"
+
+../src/patchelf --symbol-profile "${SCRATCH}/profile" --output "${SCRATCH}/libordered.so" libmany-syms.so
+if cmp -s libmany-syms.so "${SCRATCH}/libordered.so"; then
+    echo "the profile did not change the symbol order"
+    exit 1
+fi
+
+# The order only depends on the profile.
+../src/patchelf --symbol-profile "${SCRATCH}/profile" --output "${SCRATCH}/libagain.so" "${SCRATCH}/libordered.so"
+cmp "${SCRATCH}/libordered.so" "${SCRATCH}/libagain.so"
+
+cp "${SCRATCH}/libordered.so" "${SCRATCH}/libmany-syms.so"
+env LD_BIND_NOW=1 LD_LIBRARY_PATH="${SCRATCH}" "${SCRATCH}/many-syms-main"
+
+# LD_DEBUG=bindings output can be used as a profile, and the names of the
+# symbols in it go first in .dynstr.
+cat > "${SCRATCH}/bindings" <<EOB
+     12345:	binding file ./many-syms-main [0] to ./libmany-syms.so [0]: normal symbol \`f1999'
+     12345:	calling init: ./libmany-syms.so
+     12345:	binding file ./many-syms-main [0] to ./libmany-syms.so [0]: normal symbol \`f1999'
+EOB
+../src/patchelf --symbol-profile "${SCRATCH}/bindings" --compact-dynstr "${SCRATCH}/libmany-syms.so"
+$READELF -p .dynstr "${SCRATCH}/libmany-syms.so" | grep -q "\[ *1\]  f1999$"
+env LD_BIND_NOW=1 LD_LIBRARY_PATH="${SCRATCH}" "${SCRATCH}/many-syms-main"
+
+# A profile given on the command line with --batch applies to every line,
+# but is read once.
+cp libmany-syms.so "${SCRATCH}/liba.so"
+cp libmany-syms.so "${SCRATCH}/libb.so"
+printf '%s\n%s\n' "${SCRATCH}/liba.so" "${SCRATCH}/libb.so" > "${SCRATCH}/manifest"
+../src/patchelf --debug --symbol-profile "${SCRATCH}/profile" --batch "${SCRATCH}/manifest" 2> "${SCRATCH}/log"
+test "$(grep -c "read lookup counts of 2000 symbols" "${SCRATCH}/log")" -eq 1
+cmp "${SCRATCH}/liba.so" "${SCRATCH}/libordered.so"
+cmp "${SCRATCH}/libb.so" "${SCRATCH}/libordered.so"